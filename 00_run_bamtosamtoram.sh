@@ -28,6 +28,9 @@ date
 root.exe -b "samtoram.C+(\"$sam\",\"$ram\")"
 date
 
+# direct conversion, no intermediate SAM file
+#nohup root.exe -b "bamtoram.C+(\"$bam\",\"$ram\",true,true,true,ROOT::kLZMA,RAMRecord::kPhred33,32)" >& $log2 &
+
 #nohup ../samtools-1.7/samtools view -h -o $sam $bam >& $log1 &
 #nohup root.exe -b "samtoram.C+(\"$sam\",\"$ram\")" >& $log2 &
 
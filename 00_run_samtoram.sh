@@ -11,3 +11,5 @@ nohup root.exe -b "samtoram.C+(\"/data3/rdm/6148.sam\",\"../data/6148.root\")" >
 #nohup root.exe -b "samtoram.C+(\"../data/6148s10.sam\",\"../data/6148s10.root\")" >& 6148s10.log &
 
 #nohup root.exe -b "samtoram.C+(\"../data/6148s10.sam\",\"../data/6148s10-lz4.root\",true,true,true,ROOT::kLZ4)" >& 6148s10-lz4.log &
+
+#nohup root.exe -b "samtoram.C+(\"/data3/rdm/6148.sam\",\"../data/6148.root\",true,true,true,ROOT::kLZMA,RAMRecord::kPhred33,32)" >& 6148-mt.log &
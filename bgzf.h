@@ -0,0 +1,329 @@
+//
+// BGZFReader reads a BGZF compressed file (as used by BAM) and returns the
+// decompressed byte stream. BGZF blocks are independent deflate streams,
+// a reader thread collects batches of compressed blocks and worker threads
+// inflate the batches in parallel. The decompressed data is returned in
+// file order. Only zlib is needed.
+//
+
+#ifndef BGZFReader_h
+#define BGZFReader_h
+
+#include <zlib.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <RtypesCore.h>
+
+
+class BGZFReader {
+private:
+   // A batch of consecutive BGZF blocks.
+   struct Batch {
+      Long64_t             fSeq;      // batch sequence number
+      std::vector<char>    fRaw;      // compressed blocks
+      std::vector<UInt_t>  fOffsets;  // start of each block in fRaw
+      std::vector<char>    fData;     // decompressed data
+      bool                 fError;    // decompression or CRC error
+   };
+
+   FILE                     *fFile;
+   int                       fNThreads;
+   std::thread               fReader;
+   std::vector<std::thread>  fWorkers;
+
+   std::mutex                fMutex;
+   std::condition_variable   fCond;
+   std::deque<Batch *>       fFree;       // batches available to the reader
+   std::deque<Batch *>       fWork;       // batches to be decompressed
+   std::map<Long64_t, Batch *> fDone;     // decompressed batches by sequence number
+   std::vector<Batch *>      fBatches;    // all batches, for cleanup
+   bool                      fReadDone;   // reader thread finished
+   bool                      fReadError;  // reader thread found a malformed block
+   int                       fActive;     // running worker threads
+   bool                      fStop;       // stop all threads
+   bool                      fError;      // error seen in the input
+
+   Batch                    *fCurrent;    // batch being consumed
+   size_t                    fPos;        // position in fCurrent->fData
+   Long64_t                  fNext;       // sequence number of next batch to consume
+   Long64_t                  fBytesRead;  // decompressed bytes returned by Read()
+
+   static const int kBlocksPerBatch = 64;   // 64 x 64KB blocks
+
+   int  ReadBlock(std::vector<char> &raw);
+   void ReaderLoop();
+   void WorkerLoop();
+   static bool Inflate(const char *block, size_t size, std::vector<char> &out);
+   bool NextBatch();
+
+public:
+   BGZFReader() : fFile(nullptr), fNThreads(1), fReadDone(false), fReadError(false), fActive(0), fStop(false),
+                  fError(false), fCurrent(nullptr), fPos(0), fNext(0), fBytesRead(0) { }
+   ~BGZFReader() { Close(); }
+
+   bool   Open(const char *file, int nthreads = 1);
+   void   Close();
+   bool   IsError() const { return fError; }
+   Long64_t GetBytesRead() const { return fBytesRead; }
+
+   size_t Read(void *buf, size_t n);
+   bool   ReadExact(void *buf, size_t n) { return Read(buf, n) == n; }
+};
+
+
+inline bool BGZFReader::Open(const char *file, int nthreads)
+{
+   // Open a BGZF file, "-" is stdin, and start nthreads decompression threads.
+
+   Close();
+
+   fFile = strcmp(file, "-") ? fopen(file, "rb") : stdin;
+   if (!fFile)
+      return false;
+
+   fNThreads  = nthreads > 0 ? nthreads : 1;
+   fReadDone  = false;
+   fReadError = false;
+   fStop      = false;
+   fError     = false;
+   fActive    = fNThreads;
+   fNext      = 0;
+   fBytesRead = 0;
+   fPos       = 0;
+   fCurrent   = nullptr;
+
+   // enough batches to keep all workers busy while one is being consumed
+   for (int i = 0; i < 2*fNThreads + 2; i++) {
+      fBatches.push_back(new Batch);
+      fFree.push_back(fBatches.back());
+   }
+
+   fReader = std::thread(&BGZFReader::ReaderLoop, this);
+   for (int i = 0; i < fNThreads; i++)
+      fWorkers.emplace_back(&BGZFReader::WorkerLoop, this);
+   return true;
+}
+
+inline void BGZFReader::Close()
+{
+   {
+      std::lock_guard<std::mutex> lock(fMutex);
+      fStop = true;
+   }
+   fCond.notify_all();
+   if (fReader.joinable())
+      fReader.join();
+   for (auto &w : fWorkers)
+      w.join();
+   fWorkers.clear();
+   for (auto b : fBatches)
+      delete b;
+   fBatches.clear();
+   fFree.clear();
+   fWork.clear();
+   fDone.clear();
+   fCurrent = nullptr;
+   if (fFile && fFile != stdin)
+      fclose(fFile);
+   fFile = nullptr;
+}
+
+inline int BGZFReader::ReadBlock(std::vector<char> &raw)
+{
+   // Append the next compressed BGZF block to raw. Returns 1 on success,
+   // 0 at end of file and -1 on a malformed block.
+
+   unsigned char h[18];
+   size_t n = fread(h, 1, 12, fFile);
+   if (n == 0)
+      return 0;
+   if (n != 12 || h[0] != 31 || h[1] != 139 || h[2] != 8 || !(h[3] & 4))
+      return -1;
+   int xlen = h[10] | (h[11] << 8);
+   std::vector<unsigned char> extra(xlen);
+   if (fread(extra.data(), 1, xlen, fFile) != (size_t) xlen)
+      return -1;
+
+   // find the BC subfield holding the total block size - 1
+   int bsize = -1;
+   for (int i = 0; i + 4 <= xlen; ) {
+      int slen = extra[i+2] | (extra[i+3] << 8);
+      if (extra[i] == 66 && extra[i+1] == 67 && slen == 2 && i + 6 <= xlen)
+         bsize = extra[i+4] | (extra[i+5] << 8);
+      i += 4 + slen;
+   }
+   if (bsize < 0 || bsize + 1 < 12 + xlen + 8)
+      return -1;
+
+   size_t start = raw.size();
+   size_t total = bsize + 1;
+   raw.resize(start + total);
+   memcpy(&raw[start], h, 12);
+   memcpy(&raw[start + 12], extra.data(), xlen);
+   size_t rest = total - 12 - xlen;
+   if (fread(&raw[start + 12 + xlen], 1, rest, fFile) != rest) {
+      raw.resize(start);
+      return -1;
+   }
+   return 1;
+}
+
+inline void BGZFReader::ReaderLoop()
+{
+   Long64_t seq = 0;
+   int status = 1;
+   while (status == 1) {
+      Batch *b;
+      {
+         std::unique_lock<std::mutex> lock(fMutex);
+         fCond.wait(lock, [this] { return !fFree.empty() || fStop; });
+         if (fStop)
+            break;
+         b = fFree.front();
+         fFree.pop_front();
+      }
+      b->fRaw.clear();
+      b->fOffsets.clear();
+      b->fError = false;
+      for (int i = 0; i < kBlocksPerBatch; i++) {
+         UInt_t off = b->fRaw.size();
+         if ((status = ReadBlock(b->fRaw)) != 1)
+            break;
+         b->fOffsets.push_back(off);
+      }
+      std::lock_guard<std::mutex> lock(fMutex);
+      if (b->fOffsets.empty()) {
+         fFree.push_back(b);
+         break;
+      }
+      b->fSeq = seq++;
+      fWork.push_back(b);
+      fCond.notify_all();
+   }
+   std::lock_guard<std::mutex> lock(fMutex);
+   fReadDone  = true;
+   fReadError = status < 0;
+   fCond.notify_all();
+}
+
+inline bool BGZFReader::Inflate(const char *block, size_t size, std::vector<char> &out)
+{
+   // Inflate a single BGZF block and append the data to out.
+
+   int xlen = (UChar_t) block[10] | ((UChar_t) block[11] << 8);
+   const UChar_t *trailer = (const UChar_t *) block + size - 8;
+   UInt_t crc   = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((UInt_t) trailer[3] << 24);
+   UInt_t isize = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) | ((UInt_t) trailer[7] << 24);
+
+   if (isize > 65536)   // BGZF blocks hold at most 64KB
+      return false;
+
+   size_t start = out.size();
+   out.resize(start + isize);
+   if (isize == 0)
+      return true;
+
+   z_stream zs;
+   memset(&zs, 0, sizeof(zs));
+   if (inflateInit2(&zs, -15) != Z_OK)
+      return false;
+   zs.next_in   = (Bytef *) block + 12 + xlen;
+   zs.avail_in  = size - 12 - xlen - 8;
+   zs.next_out  = (Bytef *) &out[start];
+   zs.avail_out = isize;
+   int ret = inflate(&zs, Z_FINISH);
+   inflateEnd(&zs);
+   if (ret != Z_STREAM_END || zs.avail_out != 0)
+      return false;
+
+   return crc32(crc32(0L, Z_NULL, 0), (const Bytef *) &out[start], isize) == crc;
+}
+
+inline void BGZFReader::WorkerLoop()
+{
+   while (true) {
+      Batch *b;
+      {
+         std::unique_lock<std::mutex> lock(fMutex);
+         fCond.wait(lock, [this] { return !fWork.empty() || fReadDone || fStop; });
+         if (fStop || fWork.empty())
+            break;
+         b = fWork.front();
+         fWork.pop_front();
+      }
+      b->fData.clear();
+      size_t nblocks = b->fOffsets.size();
+      for (size_t i = 0; i < nblocks && !b->fError; i++) {
+         size_t end = i + 1 < nblocks ? b->fOffsets[i+1] : b->fRaw.size();
+         if (!Inflate(&b->fRaw[b->fOffsets[i]], end - b->fOffsets[i], b->fData))
+            b->fError = true;
+      }
+      std::lock_guard<std::mutex> lock(fMutex);
+      fDone[b->fSeq] = b;
+      fCond.notify_all();
+   }
+   std::lock_guard<std::mutex> lock(fMutex);
+   fActive--;
+   fCond.notify_all();
+}
+
+inline bool BGZFReader::NextBatch()
+{
+   // Make the next batch, in file order, the current one.
+
+   std::unique_lock<std::mutex> lock(fMutex);
+   if (fCurrent) {
+      fFree.push_back(fCurrent);
+      fCurrent = nullptr;
+      fCond.notify_all();
+   }
+   fCond.wait(lock, [this] { return fDone.count(fNext) || fActive == 0; });
+   auto it = fDone.find(fNext);
+   if (it == fDone.end()) {
+      fError = fReadError;
+      return false;
+   }
+   fCurrent = it->second;
+   fDone.erase(it);
+   fNext++;
+   fPos = 0;
+   if (fCurrent->fError) {
+      fError = true;
+      fCurrent->fData.clear();
+      return false;
+   }
+   return true;
+}
+
+inline size_t BGZFReader::Read(void *buf, size_t n)
+{
+   // Read up to n decompressed bytes into buf. Returns the number of bytes
+   // read, less than n only at end of file or on error.
+
+   char *out = (char *) buf;
+   size_t done = 0;
+   while (done < n) {
+      if (!fCurrent || fPos == fCurrent->fData.size()) {
+         if (fError || !NextBatch())
+            break;
+         continue;
+      }
+      size_t avail = fCurrent->fData.size() - fPos;
+      size_t l = n - done < avail ? n - done : avail;
+      memcpy(out + done, &fCurrent->fData[fPos], l);
+      fPos += l;
+      done += l;
+   }
+   fBytesRead += done;
+   return done;
+}
+
+#endif
@@ -0,0 +1,1247 @@
+//
+// RAMColumns maps RAMRecords onto the version 2 layout of the RAM tree.
+// In version 1 the tree has a single RAMRecord branch, split in members,
+// in version 2 every SAM field is a flat branch of a primitive type or a
+// variable length array, without the TObject overhead, and each branch
+// has its own compression settings, e.g. LZ4 for the small integer
+// columns and LZMA for QUAL. POS is delta encoded, it is stored absolute
+// at the first entry of every block of kPosBlock entries and as the
+// difference with the previous entry in between. With the kQualCodec
+// quality policy the QUAL of all records of a block is entropy coded at
+// once, see RAMQualCodec, and stored at the first entry of the block.
+// Likewise with qname=tokenize in the column compression spec the QNAMEs
+// of a block are tokenized and coded against the previous name, see
+// RAMNameCodec, in column qnamez.
+// Common optional fields have typed columns, integer tags like NM as Int_t,
+// RG dictionary encoded and MD and SA as strings, so e.g. a selection on
+// NM only reads column tag_NM. The other optional fields are stored as
+// text in column opt, column taglayout keeps the order of the fields of a
+// record. Used by RAMWriter to write and by RAMFile to
+// read version 2 files. RAMBatch holds the fixed size columns of a batch of
+// consecutive entries, read in bulk a basket at a time, see ReadBatch().
+//
+
+#ifndef RAMColumns_h
+#define RAMColumns_h
+
+#include <TTree.h>
+#include <TBranch.h>
+#include <TLeaf.h>
+#include <TList.h>
+#include <TParameter.h>
+#include <TDirectory.h>
+#include <TBufferFile.h>
+#include <TMath.h>
+#include <Compression.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "ramrecord.h"
+#include "ramqualcodec.h"
+#include "ramnamecodec.h"
+
+
+// The fixed size columns of consecutive entries as arrays, filled by
+// RAMColumns::ReadBatch() or RAMFile::GetBatch(). The Select methods are
+// predicates over the whole batch, they clear fSelected for the entries
+// that don't pass, in branch free loops the compiler vectorizes.
+class RAMBatch {
+public:
+   Long64_t               fFirst;      // entry of element 0
+   Int_t                  fN;          // number of entries
+   UInt_t                 fColumns;    // columns filled, RAMColumns::EColumn bits
+   std::vector<UShort_t>  fFLAG;
+   std::vector<Int_t>     fREFID;
+   std::vector<Int_t>     fPOS;        // decoded POS
+   std::vector<UChar_t>   fMAPQ;
+   std::vector<Int_t>     fEND;        // RAMRecord::GetEND(), filled with kCIGAR
+   std::vector<Int_t>     fREFNEXT;
+   std::vector<Int_t>     fPNEXT;
+   std::vector<Int_t>     fTLEN;
+   std::vector<Int_t>     fLSEQ;       // length of SEQ, filled with kSEQ
+   std::vector<UChar_t>   fSelected;   // 1 for the entries passing the predicates
+
+   RAMBatch() : fFirst(0), fN(0), fColumns(0) { }
+
+   void   Resize(Long64_t first, Int_t n, UInt_t columns);
+   void   SelectFlags(UShort_t required, UShort_t filtered);
+   void   SelectMAPQ(UChar_t minmapq);
+   void   SelectRefId(Int_t refid);
+   void   SelectOverlap(Int_t refid, Int_t start, Int_t end);
+   Int_t  GetNSelected() const;
+};
+
+
+class RAMColumns {
+public:
+   // Columns to read, see SetColumns()
+   enum EColumn {
+      kQNAME   = BIT(0),
+      kFLAG    = BIT(1),
+      kREFID   = BIT(2),
+      kPOS     = BIT(3),
+      kMAPQ    = BIT(4),
+      kCIGAR   = BIT(5),
+      kREFNEXT = BIT(6),
+      kPNEXT   = BIT(7),
+      kTLEN    = BIT(8),
+      kSEQ     = BIT(9),
+      kQUAL    = BIT(10),
+      kOPT     = BIT(11),
+      kAll     = 0xfff
+   };
+
+   static const Int_t kPosBlock = 1024;   // entries per block of delta encoded POS and coded QUAL
+   static const Int_t kClusterBlocks = 256;   // POS blocks per tree cluster, see Branch()
+
+   // Optional fields with a column of their own, see TagBranch()
+   static const Int_t kNTags      = 8;
+   static const Int_t kTagMissing = std::numeric_limits<Int_t>::min();   // integer tag not present
+
+private:
+   TTree                 *fTree;        // version 2 RAM tree
+   std::vector<char>      fQNAME;       // column buffers
+   UShort_t               fFLAG;
+   Int_t                  fREFID;
+   Int_t                  fPOS;         // POS, or delta with the POS of the previous entry
+   UChar_t                fMAPQ;
+   Int_t                  fNCIGAR;
+   std::vector<UInt_t>    fCIGAR;
+   Int_t                  fREFNEXT;
+   Int_t                  fPNEXT;
+   Int_t                  fTLEN;
+   Int_t                  fLSEQ;
+   Int_t                  fLSEQ2;
+   std::vector<UChar_t>   fSEQ;
+   Int_t                  fLQUAL;       // 0 when dropped, 1 when missing ("*"), else LSEQ
+   std::vector<UChar_t>   fQUAL;
+   Int_t                  fLQUALZ;      // size of fQUALZ, 0 except at the first entry of a block
+   std::vector<UChar_t>   fQUALZ;       // coded QUAL of a block, with kQualCodec
+   Int_t                  fLQNAMEZ;     // size of fQNAMEZ, 0 except at the first entry of a block
+   std::vector<UChar_t>   fQNAMEZ;      // coded QNAME of a block, with qname=tokenize
+   std::vector<char>      fOPT;         // optional fields without a column of their own, tab separated
+   std::vector<char>      fTagLayout;           // tags of the optional fields in order, preceded by '.' when in opt
+   Int_t                  fTagInt[kNTags];      // integer tags, kTagMissing if absent, or dictionary index, -1
+   std::vector<char>      fTagStr[kNTags];      // string tags
+   RAMRefs                fTagValues[kNTags];   // values of the dictionary encoded tags
+   bool                   fTagColumns;          // tree has the tag columns, older version 2 files don't
+   std::string            fTagFilter;           // tags read, e.g. "NMRG", empty for all, see SetColumns()
+   std::string            fTagText;             // text of a field rebuilt from the tag columns
+
+   std::vector<Long64_t>  fSegments;    // entries where the POS blocks restart, e.g. after appended trees
+   Long64_t               fLastEntry;   // entry of fLastPos, -1 if none
+   Int_t                  fLastPos;     // decoded POS of fLastEntry
+   UInt_t                 fColumns;     // columns read
+   UInt_t                 fQualityPolicy;
+
+   RAMQualCodec          *fCodec;          // QUAL codec, 0 unless kQualCodec
+   std::vector<RAMRecord> fPending;        // records of the block being written, filled when it is coded
+   Int_t                  fNPending;
+   Long64_t               fPendingStart;   // entry of fPending[0]
+   Long64_t               fQualBlock;      // block decoded in fBlockQual, -1 if none
+   std::vector<UChar_t>   fBlockQual;      // qualities of the records of a block
+   std::vector<Int_t>     fBlockOffsets;   // offset of each record in fBlockQual
+   RAMNameCodec          *fNameCodec;      // QNAME codec, 0 unless qname=tokenize
+   Long64_t               fNameBlock;      // block decoded in fBlockNames, -1 if none
+   std::vector<char>      fBlockNames;     // names of the records of a block, '\0' terminated
+   std::vector<Int_t>     fNameOffsets;    // offset of each record in fBlockNames
+   Long64_t               fBatchFirst;     // entry of fBatchPOS[0]
+   std::vector<Int_t>     fBatchPOS;       // POS decoded by the last ReadBatch()
+   TBufferFile            fBulkBuffer;     // basket read by ReadBulk()
+
+   RAMColumns(const RAMColumns &) = delete;
+   RAMColumns &operator=(const RAMColumns &) = delete;
+
+   static const char     *BranchNames(UInt_t column);
+   static const char     *TagBranch(Int_t t);
+   static Int_t           TagColumn(const char *tag);
+   static char            TagType(Int_t t) { return "iiiiidZZ"[t]; }   // 'd' is a dictionary encoded Z
+   static bool            ParseTagInt(const char *v, Int_t len, Int_t &value);
+   static Int_t           QualLength(const RAMRecord *r);
+   Long64_t               BlockStart(Long64_t entry) const;
+   Long64_t               NextBlockStart(Long64_t entry) const;
+   template <class T> void ReadBulk(const char *branch, Long64_t first, Int_t n, T *out, const T &column);
+   template <class T> void Reserve(std::vector<T> &buf, size_t n, const char *branch);
+   void                   SetBuffers(const RAMRecord *r, Long64_t entry);
+   bool                   ReadQualBlock(Long64_t block);
+   bool                   ReadNameBlock(Long64_t block);
+   Int_t                  SetTag(const char *opt, Int_t len, UInt_t &present);
+   bool                   IsTagRead(const char *tag) const;
+   void                   ReadOPT(Long64_t entry, RAMRecord *r);
+
+public:
+   RAMColumns() : fTree(nullptr), fFLAG(0), fREFID(-1), fPOS(0), fMAPQ(0), fNCIGAR(0), fREFNEXT(-1), fPNEXT(0),
+                  fTLEN(0), fLSEQ(0), fLSEQ2(0), fLQUAL(0), fLQUALZ(0), fLQNAMEZ(0), fTagColumns(false), fLastEntry(-1),
+                  fLastPos(0), fColumns(kAll), fQualityPolicy(RAMRecord::kPhred33), fCodec(nullptr), fNPending(0),
+                  fPendingStart(0), fQualBlock(-1), fNameCodec(nullptr), fNameBlock(-1), fBatchFirst(0),
+                  fBulkBuffer(TBuffer::kWrite, 32000) { }
+   ~RAMColumns() { delete fCodec; delete fNameCodec; }
+
+   static bool  IsColumnar(TTree *tree) { return tree && !tree->GetBranch("RAMRecord."); }
+   static bool  IsTokenized(const char *spec);
+
+   bool         Branch(TTree *tree, Int_t compression_algorithm, UInt_t quality_policy,
+                       const char *compression = nullptr);
+   bool         SetCompression(const char *spec);
+   void         AddHeader(std::string_view line);
+   void         Fill(const RAMRecord *r, Long64_t entry);
+   void         Flush();
+   void         AppendTree(Long64_t first, Long64_t nentries, const std::vector<Long64_t> &segments);
+   bool         AppendTags(const RAMColumns &in);
+   void         Write(TDirectory *dir);
+
+   void         Connect(TTree *tree, TDirectory *dir);
+   void         SetColumns(UInt_t columns, const char *tags = nullptr);
+   Int_t        Read(Long64_t entry, RAMRecord *r);
+   Int_t        ReadBatch(Long64_t first, Int_t n, UInt_t columns, RAMBatch &batch);
+
+   UInt_t       GetQualityPolicy() const { return fQualityPolicy; }
+   bool         HasNameCodec() const { return fNameCodec != nullptr; }
+   bool         IsBlockStart(Long64_t entry) const { return BlockStart(entry) == entry; }
+   const RAMRefs &GetTagValues(const char *tag) const;
+   const std::vector<Long64_t> &GetSegments() const { return fSegments; }
+};
+
+
+inline void RAMBatch::Resize(Long64_t first, Int_t n, UInt_t columns)
+{
+   // Make room for n entries starting at first, of the given columns, all
+   // selected.
+
+   fFirst   = first;
+   fN       = n;
+   fColumns = columns;
+   if (columns & RAMColumns::kFLAG)
+      fFLAG.resize(n);
+   if (columns & RAMColumns::kREFID)
+      fREFID.resize(n);
+   if (columns & (RAMColumns::kPOS | RAMColumns::kCIGAR))
+      fPOS.resize(n);
+   if (columns & RAMColumns::kMAPQ)
+      fMAPQ.resize(n);
+   if (columns & RAMColumns::kCIGAR)
+      fEND.resize(n);
+   if (columns & RAMColumns::kREFNEXT)
+      fREFNEXT.resize(n);
+   if (columns & RAMColumns::kPNEXT)
+      fPNEXT.resize(n);
+   if (columns & RAMColumns::kTLEN)
+      fTLEN.resize(n);
+   if (columns & RAMColumns::kSEQ)
+      fLSEQ.resize(n);
+   fSelected.assign(n, 1);
+}
+
+inline void RAMBatch::SelectFlags(UShort_t required, UShort_t filtered)
+{
+   // Keep the entries with all required and none of the filtered FLAG bits
+   // set, like samtools view -f and -F.
+
+   const UShort_t *flag = fFLAG.data();
+   UChar_t *sel = fSelected.data();
+   for (Int_t i = 0; i < fN; i++)
+      sel[i] &= ((flag[i] & required) == required) & ((flag[i] & filtered) == 0);
+}
+
+inline void RAMBatch::SelectMAPQ(UChar_t minmapq)
+{
+   // Keep the entries with MAPQ at least minmapq.
+
+   const UChar_t *mapq = fMAPQ.data();
+   UChar_t *sel = fSelected.data();
+   for (Int_t i = 0; i < fN; i++)
+      sel[i] &= mapq[i] >= minmapq;
+}
+
+inline void RAMBatch::SelectRefId(Int_t refid)
+{
+   // Keep the entries on reference refid.
+
+   const Int_t *ref = fREFID.data();
+   UChar_t *sel = fSelected.data();
+   for (Int_t i = 0; i < fN; i++)
+      sel[i] &= ref[i] == refid;
+}
+
+inline void RAMBatch::SelectOverlap(Int_t refid, Int_t start, Int_t end)
+{
+   // Keep the entries on refid overlapping the 0-based half open region
+   // [start,end). Uses the alignment end when kCIGAR is filled, otherwise
+   // the entries span one base.
+
+   const Int_t *ref = fREFID.data(), *pos = fPOS.data();
+   const Int_t *aend = (fColumns & RAMColumns::kCIGAR) ? fEND.data() : nullptr;
+   UChar_t *sel = fSelected.data();
+   if (aend) {
+      for (Int_t i = 0; i < fN; i++)
+         sel[i] &= (ref[i] == refid) & (pos[i] < end) & (aend[i] > start);
+   } else {
+      for (Int_t i = 0; i < fN; i++)
+         sel[i] &= (ref[i] == refid) & (pos[i] < end) & (pos[i] >= start);
+   }
+}
+
+inline Int_t RAMBatch::GetNSelected() const
+{
+   Int_t n = 0;
+   for (Int_t i = 0; i < fN; i++)
+      n += fSelected[i];
+   return n;
+}
+
+inline const char *RAMColumns::BranchNames(UInt_t column)
+{
+   // Branches of column, space separated.
+
+   switch (column) {
+      case kQNAME:   return "qname lqnamez";
+      case kFLAG:    return "flag";
+      case kREFID:   return "refid";
+      case kPOS:     return "pos";
+      case kMAPQ:    return "mapq";
+      case kCIGAR:   return "ncigar cigar";
+      case kREFNEXT: return "refnext";
+      case kPNEXT:   return "pnext";
+      case kTLEN:    return "tlen";
+      case kSEQ:     return "lseq lseq2 seq";
+      case kQUAL:    return "lseq lqual qual";
+      case kOPT:     return "opt taglayout tag_NM tag_AS tag_XS tag_NH tag_HI tag_RG tag_MD tag_SA";
+   }
+   return "";
+}
+
+inline const char *RAMColumns::TagBranch(Int_t t)
+{
+   // Branch of tag column t, the tag follows the "tag_" prefix. See TagType()
+   // for the types of the columns.
+
+   static const char *branches[kNTags] = { "tag_NM", "tag_AS", "tag_XS", "tag_NH", "tag_HI", "tag_RG", "tag_MD",
+                                           "tag_SA" };
+   return branches[t];
+}
+
+inline Int_t RAMColumns::TagColumn(const char *tag)
+{
+   // Tag column of tag, e.g. "NM", -1 when it has none.
+
+   for (Int_t t = 0; t < kNTags; t++)
+      if (tag[0] == TagBranch(t)[4] && tag[0] && tag[1] == TagBranch(t)[5])
+         return t;
+   return -1;
+}
+
+inline bool RAMColumns::ParseTagInt(const char *v, Int_t len, Int_t &value)
+{
+   // Parse the value of an integer tag of len characters. Returns false
+   // when it doesn't fit in an Int_t column or when printing it back would
+   // not give the same text, e.g. "+3" or "007", those are kept as text.
+
+   Int_t i = len > 0 && v[0] == '-' ? 1 : 0;
+   if (i == len || len > 11 || (v[i] == '0' && (i || len > 1)))
+      return false;
+   Long64_t x = 0;
+   for (; i < len; i++) {
+      if (v[i] < '0' || v[i] > '9')
+         return false;
+      x = 10 * x + v[i] - '0';
+   }
+   if (v[0] == '-')
+      x = -x;
+   if (x <= kTagMissing || x > std::numeric_limits<Int_t>::max())
+      return false;
+   value = (Int_t) x;
+   return true;
+}
+
+inline Int_t RAMColumns::QualLength(const RAMRecord *r)
+{
+   // Number of QUAL bytes stored for r: a dropped QUAL is not stored, a
+   // missing one ('*' padded with 0's) as '*'.
+
+   const UChar_t *qual = r->v_qual;
+   if (!qual || !r->v_lseq)
+      return 0;
+   if (!r->TestBit(RAMRecord::kPhred33) && !r->TestBit(RAMRecord::kIlluminaBinning) &&
+       r->TestBit(RAMRecord::kDrop))
+      return 0;
+   if (!r->TestBit(RAMRecord::kIlluminaBinning) && qual[0] == '*' && (r->v_lseq == 1 || qual[1] == 0))
+      return 1;
+   return r->v_lseq;
+}
+
+inline Long64_t RAMColumns::BlockStart(Long64_t entry) const
+{
+   // First entry of the POS block of entry, where POS is stored absolute.
+
+   auto it = std::upper_bound(fSegments.begin(), fSegments.end(), entry);
+   Long64_t segment = it == fSegments.begin() ? 0 : *(it - 1);
+   return segment + (entry - segment) / kPosBlock * kPosBlock;
+}
+
+inline Long64_t RAMColumns::NextBlockStart(Long64_t entry) const
+{
+   // First entry of the POS block after the block of entry.
+
+   auto it = std::upper_bound(fSegments.begin(), fSegments.end(), entry);
+   Long64_t segment = it == fSegments.begin() ? 0 : *(it - 1);
+   Long64_t next = segment + ((entry - segment) / kPosBlock + 1) * kPosBlock;
+   return it == fSegments.end() ? next : std::min(next, *it);
+}
+
+template <class T>
+inline void RAMColumns::ReadBulk(const char *branch, Long64_t first, Int_t n, T *out, const T &column)
+{
+   // Read the n values of the fixed size column branch starting at entry
+   // first into out, a basket at a time with the bulk I/O of TBranch. When
+   // the branch doesn't support it the entries are read one by one into
+   // the column buffer of branch, column.
+
+   TBranch *b = fTree->GetBranch(branch);
+   Long64_t entry = first, last = first + n;
+   if (b->GetBulkRead().SupportsBulkRead()) {
+      while (entry < last) {
+         // the baskets are read whole, from their first entry
+         Long64_t *basketEntry = b->GetBasketEntry();
+         Int_t basket = TMath::BinarySearch((Long64_t) b->GetWriteBasket() + 1, basketEntry, entry);
+         if (!basketEntry || basket < 0)
+            break;
+         Long64_t start = basketEntry[basket];
+         fBulkBuffer.SetBufferOffset(0);
+         Int_t count = b->GetBulkRead().GetBulkEntries(start, fBulkBuffer);
+         if (count <= 0 || start + count <= entry)
+            break;
+         const T *values = reinterpret_cast<const T *>(fBulkBuffer.GetCurrent());
+         Long64_t end = std::min(start + count, last);
+         memcpy(out + (entry - first), values + (entry - start), (end - entry) * sizeof(T));
+         entry = end;
+      }
+   }
+   for (; entry < last; entry++) {
+      b->GetEntry(entry, 1);
+      out[entry - first] = column;
+   }
+}
+
+template <class T>
+inline void RAMColumns::Reserve(std::vector<T> &buf, size_t n, const char *branch)
+{
+   // Make buf hold at least n elements, the branch address follows a
+   // reallocation.
+
+   if (n <= buf.size())
+      return;
+   buf.resize(std::max(n, 2 * buf.size()));
+   fTree->SetBranchAddress(branch, buf.data());
+}
+
+inline bool RAMColumns::Branch(TTree *tree, Int_t compression_algorithm, UInt_t quality_policy,
+                               const char *compression)
+{
+   // Create the version 2 branches in tree. The fixed size columns are
+   // compressed with LZ4, which is fast to decompress, QNAME, CIGAR, SEQ
+   // and the optional fields with compression_algorithm at level 1 and QUAL,
+   // the largest column, with compression_algorithm at level 6, then as
+   // given by the column compression spec compression, see SetCompression().
+   // The quality policy applies to the whole file and is stored in the
+   // UserInfo of tree. With kQualCodec the coded blocks of QUAL are stored
+   // uncompressed in column qualz, with qname=tokenize in compression the
+   // coded blocks of QNAME in column qnamez, compressed like qname. The tree
+   // clusters are kClusterBlocks whole POS blocks, so that they can be
+   // copied as is, see RAMWriter::CopyCluster(). Returns false, with an
+   // error, on an invalid spec.
+
+   fTree = tree;
+   fQualityPolicy = quality_policy;
+   if (quality_policy & RAMRecord::kQualCodec)
+      fCodec = new RAMQualCodec;
+   if (IsTokenized(compression))
+      fNameCodec = new RAMNameCodec;
+   fQNAME.resize(256);
+   fCIGAR.resize(64);
+   fSEQ.resize(256);
+   fQUAL.resize(512);
+   fQUALZ.resize(fCodec ? 65536 : 1);
+   fQNAMEZ.resize(fNameCodec ? 65536 : 1);
+   fOPT.resize(1024);
+   fQNAME[0] = fOPT[0] = '\0';
+
+   const Int_t bufsize = 64000;
+   if (fNameCodec) {
+      fTree->Branch("lqnamez", &fLQNAMEZ,      "lqnamez/I",          bufsize);
+      fTree->Branch("qnamez",  fQNAMEZ.data(), "qnamez[lqnamez]/b",  bufsize);
+   } else
+      fTree->Branch("qname",   fQNAME.data(), "qname/C",            bufsize);
+   fTree->Branch("flag",    &fFLAG,        "flag/s",             bufsize);
+   fTree->Branch("refid",   &fREFID,       "refid/I",            bufsize);
+   fTree->Branch("pos",     &fPOS,         "pos/I",              bufsize);
+   fTree->Branch("mapq",    &fMAPQ,        "mapq/b",             bufsize);
+   fTree->Branch("ncigar",  &fNCIGAR,      "ncigar/I",           bufsize);
+   fTree->Branch("cigar",   fCIGAR.data(), "cigar[ncigar]/i",    bufsize);
+   fTree->Branch("refnext", &fREFNEXT,     "refnext/I",          bufsize);
+   fTree->Branch("pnext",   &fPNEXT,       "pnext/I",            bufsize);
+   fTree->Branch("tlen",    &fTLEN,        "tlen/I",             bufsize);
+   fTree->Branch("lseq",    &fLSEQ,        "lseq/I",             bufsize);
+   fTree->Branch("lseq2",   &fLSEQ2,       "lseq2/I",            bufsize);
+   fTree->Branch("seq",     fSEQ.data(),   "seq[lseq2]/b",       bufsize);
+   fTree->Branch("lqual",   &fLQUAL,       "lqual/I",            bufsize);
+   if (fCodec) {
+      fTree->Branch("lqualz", &fLQUALZ,      "lqualz/I",           bufsize);
+      fTree->Branch("qualz",  fQUALZ.data(), "qualz[lqualz]/b",    bufsize);
+   } else
+      fTree->Branch("qual",   fQUAL.data(),  "qual[lqual]/b",      bufsize);
+   fTree->Branch("opt",     fOPT.data(),   "opt/C",              bufsize);
+   fTagLayout.assign(64, '\0');
+   fTree->Branch("taglayout", fTagLayout.data(), "taglayout/C",  bufsize);
+   fTagColumns = true;
+   for (Int_t t = 0; t < kNTags; t++) {
+      TString leaf = TString::Format("%s/%s", TagBranch(t), TagType(t) == 'Z' ? "C" : "I");
+      if (TagType(t) == 'Z') {
+         fTagStr[t].assign(64, '\0');
+         fTree->Branch(TagBranch(t), fTagStr[t].data(), leaf, bufsize);
+      } else
+         fTree->Branch(TagBranch(t), &fTagInt[t], leaf, bufsize);
+   }
+
+   const char *fixed[] = { "flag", "refid", "pos", "mapq", "ncigar", "refnext", "pnext", "tlen", "lseq", "lseq2",
+                           "lqual" };
+   for (auto b : fixed)
+      fTree->GetBranch(b)->SetCompressionSettings(ROOT::CompressionSettings(ROOT::kLZ4, 4));
+   auto algorithm = (ROOT::ECompressionAlgorithm) compression_algorithm;
+   for (auto b : { "cigar", "seq", "opt", "taglayout" })
+      fTree->GetBranch(b)->SetCompressionSettings(ROOT::CompressionSettings(algorithm, 1));
+   if (fNameCodec) {
+      fTree->GetBranch("lqnamez")->SetCompressionSettings(ROOT::CompressionSettings(ROOT::kLZ4, 4));
+      fTree->GetBranch("qnamez")->SetCompressionSettings(ROOT::CompressionSettings(algorithm, 1));
+   } else
+      fTree->GetBranch("qname")->SetCompressionSettings(ROOT::CompressionSettings(algorithm, 1));
+   for (Int_t t = 0; t < kNTags; t++)
+      fTree->GetBranch(TagBranch(t))->SetCompressionSettings(TagType(t) == 'Z' ?
+         ROOT::CompressionSettings(algorithm, 1) : ROOT::CompressionSettings(ROOT::kLZ4, 4));
+   if (fCodec) {
+      fTree->GetBranch("lqualz")->SetCompressionSettings(ROOT::CompressionSettings(ROOT::kLZ4, 4));
+      fTree->GetBranch("qualz")->SetCompressionSettings(0);
+   } else
+      fTree->GetBranch("qual")->SetCompressionSettings(ROOT::CompressionSettings(algorithm, 6));
+   fTree->SetAutoFlush(kClusterBlocks * kPosBlock);
+
+   fTree->GetUserInfo()->Add(new TParameter<Int_t>("quality_policy", quality_policy));
+   return SetCompression(compression);
+}
+
+inline bool RAMColumns::IsTokenized(const char *spec)
+{
+   // Whether the column compression spec selects the name codec, with
+   // qname=tokenize, see SetCompression().
+
+   std::string s = spec ? spec : "";
+   std::replace(s.begin(), s.end(), ',', ' ');
+   std::istringstream items(s);
+   std::string item;
+   while (items >> item)
+      if (item == "qname=tokenize")
+         return true;
+   return false;
+}
+
+inline bool RAMColumns::SetCompression(const char *spec)
+{
+   // Set the compression of columns, spec is a comma or space separated
+   // list of column=algorithm:level, e.g. "qual=lzma:9,qname=zstd:5". The
+   // columns are the branch names, the algorithms zlib, lzma, lz4 and zstd.
+   // The item qname=tokenize stores QNAME in column qnamez instead, coded
+   // by RAMNameCodec, it changes the layout and must be given to Branch().
+   // Returns false, with an error, on an invalid spec.
+
+   std::string s = spec ? spec : "";
+   std::replace(s.begin(), s.end(), ',', ' ');
+   std::istringstream items(s);
+   std::string item;
+   while (items >> item) {
+      if (item == "qname=tokenize") {
+         if (fNameCodec)
+            continue;
+         ::Error("RAMColumns::SetCompression", "qname=tokenize must be given when the file is created");
+         return false;
+      }
+      auto eq    = item.find('=');
+      auto colon = item.find(':', eq);
+      TBranch *b = eq != std::string::npos ? fTree->GetBranch(item.substr(0, eq).c_str()) : nullptr;
+      std::string alg = eq != std::string::npos ? item.substr(eq + 1, colon - eq - 1) : "";
+      Int_t level = colon != std::string::npos ? atoi(item.c_str() + colon + 1) : 1;
+      Int_t algorithm = alg == "zlib" ? ROOT::kZLIB : alg == "lzma" ? ROOT::kLZMA : alg == "lz4" ? ROOT::kLZ4 :
+                        alg == "zstd" ? ROOT::kZSTD : -1;
+      if (!b || algorithm < 0 || level < 0 || level > 9) {
+         ::Error("RAMColumns::SetCompression", "invalid column compression %s", item.c_str());
+         return false;
+      }
+      b->SetCompressionSettings(ROOT::CompressionSettings((ROOT::ECompressionAlgorithm) algorithm, level));
+   }
+   return true;
+}
+
+inline void RAMColumns::AddHeader(std::string_view line)
+{
+   // Enter the read group of a SAM @RG header line (ID) in the dictionary
+   // of RG, so files with the same headers have the same dictionary and
+   // can be merged by copying.
+
+   if (line.compare(0, 4, "@RG\t"))
+      return;
+   auto id = line.find("\tID:");
+   if (id == std::string_view::npos)
+      return;
+   std::string_view name = line.substr(id + 4);
+   name = name.substr(0, name.find('\t'));
+   if (!name.empty())
+      fTagValues[TagColumn("RG")].GetRefId(name);
+}
+
+inline void RAMColumns::Fill(const RAMRecord *r, Long64_t entry)
+{
+   // Fill r as entry of the tree. With kQualCodec or qname=tokenize the
+   // records are kept until their block is complete, see Flush().
+
+   if (!fCodec && !fNameCodec) {
+      SetBuffers(r, entry);
+      fTree->Fill();
+      return;
+   }
+   if (fNPending && entry == BlockStart(entry))
+      Flush();
+   if (fNPending == 0)
+      fPendingStart = entry;
+   if (fNPending == (Int_t) fPending.size())
+      fPending.emplace_back();
+   fPending[fNPending++] = *r;
+}
+
+inline void RAMColumns::Flush()
+{
+   // Code the QUAL and QNAME of the pending records and fill them. Must be
+   // called before the tree is written or other trees are appended.
+
+   if (fNPending == 0)
+      return;
+
+   std::vector<Int_t> lens(fNPending);
+   std::vector<UChar_t> z;
+   if (fCodec) {
+      fBlockQual.clear();
+      for (Int_t i = 0; i < fNPending; i++) {
+         lens[i] = QualLength(&fPending[i]);
+         fBlockQual.insert(fBlockQual.end(), fPending[i].v_qual, fPending[i].v_qual + lens[i]);
+      }
+      fCodec->Encode(fBlockQual.data(), lens, z);
+      Reserve(fQUALZ, z.size(), "qualz");
+      memcpy(fQUALZ.data(), z.data(), z.size());
+   }
+   Int_t lqnamez = 0;
+   if (fNameCodec) {
+      fBlockNames.clear();
+      for (Int_t i = 0; i < fNPending; i++) {
+         const TString &qname = fPending[i].v_qname;
+         lens[i] = qname.Length();
+         fBlockNames.insert(fBlockNames.end(), qname.Data(), qname.Data() + lens[i]);
+      }
+      std::vector<UChar_t> zn;
+      fNameCodec->Encode(fBlockNames.data(), lens, zn);
+      Reserve(fQNAMEZ, zn.size(), "qnamez");
+      memcpy(fQNAMEZ.data(), zn.data(), zn.size());
+      lqnamez = zn.size();
+   }
+
+   for (Int_t i = 0; i < fNPending; i++) {
+      fLQUALZ   = i == 0 ? z.size() : 0;
+      fLQNAMEZ  = i == 0 ? lqnamez : 0;
+      SetBuffers(&fPending[i], fPendingStart + i);
+      fTree->Fill();
+   }
+   fNPending = 0;
+}
+
+inline void RAMColumns::SetBuffers(const RAMRecord *r, Long64_t entry)
+{
+   // Set the column buffers from r, to be filled as entry of the tree.
+
+   if (!fNameCodec) {
+      Int_t lqname = r->v_qname.Length();
+      Reserve(fQNAME, lqname + 1, "qname");
+      memcpy(fQNAME.data(), r->v_qname.Data(), lqname);
+      fQNAME[lqname] = '\0';
+   }
+
+   fFLAG    = r->v_flag;
+   fREFID   = r->v_refid;
+   fMAPQ    = r->v_mapq;
+   fREFNEXT = r->v_refnext;
+   fPNEXT   = r->v_pnext;
+   fTLEN    = r->v_tlen;
+
+   // POS, unsigned arithmetic as the difference may overflow
+   if (entry == BlockStart(entry))
+      fPOS = r->v_pos;
+   else
+      fPOS = (Int_t) ((UInt_t) r->v_pos - (UInt_t) fLastPos);
+   fLastPos   = r->v_pos;
+   fLastEntry = entry;
+
+   fNCIGAR = r->v_cigar ? r->v_ncigar_op : 0;
+   Reserve(fCIGAR, fNCIGAR, "cigar");
+   if (fNCIGAR)
+      memcpy(fCIGAR.data(), r->v_cigar, fNCIGAR * sizeof(UInt_t));
+
+   fLSEQ  = r->v_lseq;
+   fLSEQ2 = r->v_seq ? r->v_lseq2 : 0;
+   Reserve(fSEQ, fLSEQ2, "seq");
+   if (fLSEQ2)
+      memcpy(fSEQ.data(), r->v_seq, fLSEQ2);
+
+   fLQUAL = QualLength(r);
+   if (!fCodec) {
+      Reserve(fQUAL, fLQUAL, "qual");
+      if (fLQUAL)
+         memcpy(fQUAL.data(), r->v_qual, fLQUAL);
+   }
+
+   // the optional fields go to their tag column, when they have one, the
+   // others to opt, the layout records the order
+   for (Int_t t = 0; t < kNTags; t++) {
+      fTagInt[t] = TagType(t) == 'i' ? kTagMissing : -1;
+      if (TagType(t) == 'Z')
+         fTagStr[t][0] = '\0';
+   }
+   size_t lopt = 0;
+   for (Int_t i = 0; i < r->v_nopt; i++)
+      lopt += r->v_opt[i].Length() + 1;
+   Reserve(fOPT, lopt + 1, "opt");
+   Reserve(fTagLayout, 3 * r->v_nopt + 1, "taglayout");
+   char *layout = fTagLayout.data();
+   UInt_t present = 0;
+   char *p = fOPT.data();
+   for (Int_t i = 0; i < r->v_nopt; i++) {
+      const TString &opt = r->v_opt[i];
+      if (fTagColumns && SetTag(opt.Data(), opt.Length(), present) >= 0) {
+         *layout++ = opt[0];
+         *layout++ = opt[1];
+         continue;
+      }
+      *layout++ = '.';
+      *layout++ = opt.Length() > 0 ? opt[0] : ' ';
+      *layout++ = opt.Length() > 1 ? opt[1] : ' ';
+      if (p != fOPT.data())
+         *p++ = '\t';
+      memcpy(p, opt.Data(), opt.Length());
+      p += opt.Length();
+   }
+   *p = '\0';
+   *layout = '\0';
+}
+
+inline Int_t RAMColumns::SetTag(const char *opt, Int_t len, UInt_t &present)
+{
+   // Store the optional field opt of len characters in its tag column.
+   // Returns the tag column, -1 when opt is kept as text: it has no column,
+   // another type or a value the column can't reproduce, or its tag was
+   // already present in the record, as marked in present.
+
+   if (len < 5 || opt[2] != ':' || opt[4] != ':')
+      return -1;
+   const char *v = opt + 5;
+   Int_t lv = len - 5;
+   Int_t t  = TagColumn(opt);
+   if (t < 0 || (present & BIT(t)) || opt[3] != (TagType(t) == 'i' ? 'i' : 'Z'))
+      return -1;
+   if (TagType(t) == 'i') {
+      if (!ParseTagInt(v, lv, fTagInt[t]))
+         return -1;
+   } else if (TagType(t) == 'd') {
+      // values starting with '*' are not entered in a RAMRefs
+      if ((fTagInt[t] = fTagValues[t].GetRefId(v, lv)) < 0)
+         return -1;
+   } else {
+      Reserve(fTagStr[t], lv + 1, TagBranch(t));
+      memcpy(fTagStr[t].data(), v, lv);
+      fTagStr[t][lv] = '\0';
+   }
+   present |= BIT(t);
+   return t;
+}
+
+inline void RAMColumns::AppendTree(Long64_t first, Long64_t nentries, const std::vector<Long64_t> &segments)
+{
+   // Record that the nentries entries starting at first were copied from a
+   // version 2 tree with the given POS segments. The POS blocks of the copy
+   // start at first, the next filled entry starts a new block.
+
+   if (fSegments.empty() || fSegments.back() != first)
+      fSegments.push_back(first);
+   for (auto s : segments)
+      if (s > 0 && s < nentries)
+         fSegments.push_back(first + s);
+   fSegments.push_back(first + nentries);
+   fLastEntry = -1;
+}
+
+inline bool RAMColumns::AppendTags(const RAMColumns &in)
+{
+   // Check that the entries of in can be copied as is: the values of its
+   // dictionary encoded tags must have the same indices as here, i.e. of
+   // each pair of dictionaries one is the start of the other. The longer
+   // one is kept. Returns false, without changing anything, when they
+   // differ.
+
+   auto prefix = [](const RAMRefs &a, const RAMRefs &b) {
+      if (a.Size() > b.Size())
+         return false;
+      for (ULong_t i = 0; i < a.Size(); i++)
+         if (strcmp(a.GetRefName(i), b.GetRefName(i)))
+            return false;
+      return true;
+   };
+   auto compatible = [&prefix](const RAMRefs &a, const RAMRefs &b) { return prefix(a, b) || prefix(b, a); };
+
+   if (fTagColumns != in.fTagColumns)
+      return false;
+   for (Int_t t = 0; t < kNTags; t++)
+      if (!compatible(fTagValues[t], in.fTagValues[t]))
+         return false;
+
+   for (Int_t t = 0; t < kNTags; t++)
+      if (in.fTagValues[t].Size() > fTagValues[t].Size())
+         fTagValues[t] = in.fTagValues[t];
+   return true;
+}
+
+inline void RAMColumns::Write(TDirectory *dir)
+{
+   // Store the POS segments, when there are any, and the dictionaries of
+   // the dictionary encoded tags next to the tree.
+
+   if (!fSegments.empty())
+      dir->WriteObjectAny(&fSegments, "vector<Long64_t>", "PosSegments");
+   for (Int_t t = 0; fTagColumns && t < kNTags; t++)
+      if (TagType(t) == 'd')
+         dir->WriteObjectAny(&fTagValues[t], "RAMRefs", TString::Format("TagValues_%s", TagBranch(t) + 4));
+}
+
+inline const RAMRefs &RAMColumns::GetTagValues(const char *tag) const
+{
+   // Dictionary of the values of the dictionary encoded tag, e.g. "RG". The
+   // tag column holds the index of the value, to select records with
+   // RG:Z:lane3 look up the index of "lane3" with FindRefId(). The
+   // dictionary is empty for other tags.
+
+   Int_t t = TagColumn(tag);
+   return fTagValues[t >= 0 && TagType(t) == 'd' ? t : 0];
+}
+
+inline void RAMColumns::Connect(TTree *tree, TDirectory *dir)
+{
+   // Connect the branches of the version 2 tree for reading, see Read().
+   // The column buffers are sized with the maxima recorded in the tree, the
+   // arrays are grown by Read() when a count exceeds them.
+
+   fTree = tree;
+   fLastEntry = -1;
+   fBatchPOS.clear();
+
+   std::vector<Long64_t> *segments = nullptr;
+   if (dir)
+      dir->GetObject("PosSegments", segments);
+   if (segments) {
+      fSegments = *segments;
+      delete segments;
+   }
+
+   fTagColumns = tree->GetBranch("taglayout") != nullptr;
+   for (Int_t t = 0; fTagColumns && dir && t < kNTags; t++) {
+      RAMRefs *refs = nullptr;
+      if (TagType(t) == 'd')
+         dir->GetObject(TString::Format("TagValues_%s", TagBranch(t) + 4), refs);
+      if (refs) {
+         fTagValues[t] = *refs;
+         delete refs;
+      }
+   }
+
+   TParameter<Int_t> *policy = (TParameter<Int_t> *) tree->GetUserInfo()->FindObject("quality_policy");
+   fQualityPolicy = policy ? policy->GetVal() : RAMRecord::kPhred33;
+   if (tree->GetBranch("qualz"))
+      fCodec = new RAMQualCodec;
+   if (tree->GetBranch("qnamez"))
+      fNameCodec = new RAMNameCodec;
+   fQualBlock = fNameBlock = -1;
+
+   auto maximum = [tree](const char *leaf) {
+      TLeaf *l = tree->GetLeaf(leaf);
+      return l ? std::max(l->GetMaximum(), 0) : 0;
+   };
+   fQNAME.resize(maximum("qname") + 2);
+   fCIGAR.resize(maximum("ncigar") + 1);
+   fSEQ.resize(maximum("lseq2") + 1);
+   fQUAL.resize(maximum("lqual") + 1);
+   fQUALZ.resize(maximum("lqualz") + 1);
+   fQNAMEZ.resize(maximum("lqnamez") + 1);
+   fOPT.resize(maximum("opt") + 2);
+
+   if (!fNameCodec)
+      fTree->SetBranchAddress("qname",   fQNAME.data());
+   fTree->SetBranchAddress("flag",    &fFLAG);
+   fTree->SetBranchAddress("refid",   &fREFID);
+   fTree->SetBranchAddress("pos",     &fPOS);
+   fTree->SetBranchAddress("mapq",    &fMAPQ);
+   fTree->SetBranchAddress("ncigar",  &fNCIGAR);
+   fTree->SetBranchAddress("cigar",   fCIGAR.data());
+   fTree->SetBranchAddress("refnext", &fREFNEXT);
+   fTree->SetBranchAddress("pnext",   &fPNEXT);
+   fTree->SetBranchAddress("tlen",    &fTLEN);
+   fTree->SetBranchAddress("lseq",    &fLSEQ);
+   fTree->SetBranchAddress("lseq2",   &fLSEQ2);
+   fTree->SetBranchAddress("seq",     fSEQ.data());
+   fTree->SetBranchAddress("lqual",   &fLQUAL);
+   fTree->SetBranchAddress("opt",     fOPT.data());
+   if (fTagColumns) {
+      fTagLayout.assign(maximum("taglayout") + 2, '\0');
+      fTree->SetBranchAddress("taglayout", fTagLayout.data());
+      for (Int_t t = 0; t < kNTags; t++) {
+         if (TagType(t) == 'Z') {
+            fTagStr[t].assign(maximum(TagBranch(t)) + 2, '\0');
+            fTree->SetBranchAddress(TagBranch(t), fTagStr[t].data());
+         } else
+            fTree->SetBranchAddress(TagBranch(t), &fTagInt[t]);
+      }
+   }
+   if (fCodec) {
+      // the coded blocks are only read at the first entry of a block
+      fTree->SetBranchAddress("lqualz", &fLQUALZ);
+      fTree->SetBranchAddress("qualz",  fQUALZ.data());
+      fTree->SetBranchStatus("lqualz", 0);
+      fTree->SetBranchStatus("qualz", 0);
+   } else
+      fTree->SetBranchAddress("qual",   fQUAL.data());
+   if (fNameCodec) {
+      fTree->SetBranchAddress("lqnamez", &fLQNAMEZ);
+      fTree->SetBranchAddress("qnamez",  fQNAMEZ.data());
+      fTree->SetBranchStatus("lqnamez", 0);
+      fTree->SetBranchStatus("qnamez", 0);
+   }
+}
+
+inline bool RAMColumns::ReadQualBlock(Long64_t block)
+{
+   // Read and decode the coded QUAL of the block starting at entry block.
+
+   fQualBlock = -1;
+   bool ok = fTree->GetBranch("lqualz")->GetEntry(block, 1) > 0 && fLQUALZ >= 0;
+   if (ok)
+      Reserve(fQUALZ, fLQUALZ, "qualz");
+   if (!ok || fTree->GetBranch("qualz")->GetEntry(block, 1) < 0 ||
+       !fCodec->Decode(fQUALZ.data(), fLQUALZ, fBlockQual, fBlockOffsets)) {
+      ::Error("RAMColumns::ReadQualBlock", "cannot decode the QUAL of the block at entry %lld", block);
+      return false;
+   }
+   fQualBlock = block;
+   return true;
+}
+
+inline bool RAMColumns::ReadNameBlock(Long64_t block)
+{
+   // Read and decode the coded QNAME of the block starting at entry block.
+
+   fNameBlock = -1;
+   bool ok = fTree->GetBranch("lqnamez")->GetEntry(block, 1) > 0 && fLQNAMEZ >= 0;
+   if (ok)
+      Reserve(fQNAMEZ, fLQNAMEZ, "qnamez");
+   if (!ok || fTree->GetBranch("qnamez")->GetEntry(block, 1) < 0 ||
+       !fNameCodec->Decode(fQNAMEZ.data(), fLQNAMEZ, fBlockNames, fNameOffsets)) {
+      ::Error("RAMColumns::ReadNameBlock", "cannot decode the QNAME of the block at entry %lld", block);
+      return false;
+   }
+   fNameBlock = block;
+   return true;
+}
+
+inline void RAMColumns::SetColumns(UInt_t columns, const char *tags)
+{
+   // Read only the given columns (EColumn bits), e.g. kREFID | kPOS | kCIGAR
+   // to compute the alignment span. The other fields of the record keep
+   // their previous values. With kOPT, tags limits the optional fields read
+   // to the given space separated tags, e.g. "NM RG", when these have a
+   // column of their own only those columns are read, opt only for the
+   // records that have one of the tags in it.
+
+   fTagFilter.clear();
+   std::istringstream tokens(tags ? tags : "");
+   std::string tag;
+   while (tokens >> tag) {
+      if (tag.size() == 2)
+         fTagFilter += tag;
+      else
+         ::Error("RAMColumns::SetColumns", "invalid tag %s", tag.c_str());
+   }
+
+   fColumns = columns;
+   fLastEntry = -1;
+   fTree->SetBranchStatus("*", 0);
+   for (UInt_t c = kQNAME; c <= kOPT; c <<= 1) {
+      if (!(columns & c))
+         continue;
+      std::istringstream names(BranchNames(c));
+      std::string name;
+      while (names >> name)
+         if (fTree->GetBranch(name.c_str()))
+            fTree->SetBranchStatus(name.c_str(), 1);
+   }
+   if ((columns & kOPT) && fTagColumns && !fTagFilter.empty()) {
+      for (Int_t t = 0; t < kNTags; t++)
+         fTree->SetBranchStatus(TagBranch(t), IsTagRead(TagBranch(t) + 4));
+      fTree->SetBranchStatus("opt", 0);
+   }
+}
+
+inline bool RAMColumns::IsTagRead(const char *tag) const
+{
+   // Is the optional field with tag read, see SetColumns().
+
+   for (size_t i = 0; i < fTagFilter.size(); i += 2)
+      if (fTagFilter[i] == tag[0] && fTagFilter[i+1] == tag[1])
+         return true;
+   return fTagFilter.empty();
+}
+
+inline Int_t RAMColumns::Read(Long64_t entry, RAMRecord *r)
+{
+   // Read entry of the tree into r. Returns the number of bytes read, 0
+   // when entry does not exist.
+
+   // the counts of the arrays are read first, the buffers sized with the
+   // maxima of the tree may be too small, e.g. after copied baskets
+   if ((fColumns & kCIGAR) && fTree->GetBranch("ncigar")->GetEntry(entry, 1) > 0)
+      Reserve(fCIGAR, std::max(fNCIGAR, 0), "cigar");
+   if ((fColumns & kSEQ) && fTree->GetBranch("lseq2")->GetEntry(entry, 1) > 0)
+      Reserve(fSEQ, std::max(fLSEQ2, 0), "seq");
+   if ((fColumns & kQUAL) && !fCodec && fTree->GetBranch("lqual")->GetEntry(entry, 1) > 0)
+      Reserve(fQUAL, std::max(fLQUAL, 0), "qual");
+
+   Int_t nbytes = fTree->GetEntry(entry);
+   if (nbytes <= 0)
+      return nbytes;
+
+   if (fColumns & kPOS) {
+      Long64_t start = BlockStart(entry);
+      Int_t pos = fPOS;
+      if (entry != start) {
+         if (entry != fLastEntry + 1 && entry > fBatchFirst && entry <= fBatchFirst + (Long64_t) fBatchPOS.size())
+            // after a batch, e.g. the entries selected by a scan of the batch
+            fLastPos = fBatchPOS[entry - 1 - fBatchFirst];
+         else if (entry != fLastEntry + 1) {
+            // random access, add up the deltas from the start of the block
+            TBranch *b = fTree->GetBranch("pos");
+            Int_t delta = fPOS;
+            UInt_t p = 0;
+            for (Long64_t j = start; j < entry; j++) {
+               b->GetEntry(j);
+               p = j == start ? (UInt_t) fPOS : p + (UInt_t) fPOS;
+            }
+            fPOS = delta;
+            fLastPos = (Int_t) p;
+         }
+         pos = (Int_t) ((UInt_t) fLastPos + (UInt_t) fPOS);
+      }
+      r->v_pos   = pos;
+      fLastPos   = pos;
+      fLastEntry = entry;
+   }
+
+   if ((fColumns & kQNAME) && fNameCodec) {
+      // the names of a block are decoded at once
+      Long64_t block = BlockStart(entry);
+      Long64_t i = entry - block;
+      if ((block == fNameBlock || ReadNameBlock(block)) && i + 1 < (Long64_t) fNameOffsets.size())
+         r->SetQNAME(fBlockNames.data() + fNameOffsets[i]);
+      else
+         r->SetQNAME("");
+   } else if (fColumns & kQNAME)
+      r->SetQNAME(fQNAME.data());
+   if (fColumns & kFLAG)
+      r->v_flag = fFLAG;
+   if (fColumns & kREFID)
+      r->v_refid = fREFID;
+   if (fColumns & kMAPQ)
+      r->v_mapq = fMAPQ;
+   if (fColumns & kCIGAR)
+      r->SetCIGAR(fCIGAR.data(), fNCIGAR);
+   if (fColumns & kREFNEXT)
+      r->v_refnext = fREFNEXT;
+   if (fColumns & kPNEXT)
+      r->v_pnext = fPNEXT;
+   if (fColumns & kTLEN)
+      r->v_tlen = fTLEN;
+   if (fColumns & kSEQ)
+      r->SetPackedSEQ(fSEQ.data(), fLSEQ);
+   else if (fColumns & kQUAL) {
+      r->v_lseq  = fLSEQ;
+      r->v_lseq2 = (fLSEQ + 1) / 2;
+   }
+   if (fColumns & kQUAL) {
+      // the quality policy is per file, QUAL has v_lseq entries, a dropped or
+      // missing QUAL is padded with 0's
+      const UInt_t kQualityBits = RAMRecord::kPhred33 | RAMRecord::kIlluminaBinning | RAMRecord::kDrop |
+                                  RAMRecord::kQualCodec;
+      r->SetBit(kQualityBits, kFALSE);
+      r->SetBit(fQualityPolicy & kQualityBits);
+      const UChar_t *qual = fQUAL.data();
+      Int_t lqual = fLQUAL;
+      if (fCodec) {
+         // the records of a block are decoded at once
+         Long64_t block = BlockStart(entry);
+         Long64_t i = entry - block;
+         if ((block == fQualBlock || ReadQualBlock(block)) && i + 1 < (Long64_t) fBlockOffsets.size()) {
+            qual  = fBlockQual.data() + fBlockOffsets[i];
+            lqual = fBlockOffsets[i+1] - fBlockOffsets[i];
+         } else
+            lqual = 0;
+      }
+      if (r->v_qual != nullptr && fLSEQ > r->fQualSize) {
+         delete [] r->v_qual;
+         r->v_qual = nullptr;
+      }
+      if (r->v_qual == nullptr && fLSEQ) {
+         r->fQualSize = fLSEQ;
+         r->v_qual = new UChar_t[fLSEQ];
+      }
+      lqual = std::min(lqual, fLSEQ);
+      if (lqual)
+         memcpy(r->v_qual, qual, lqual);
+      if (lqual < fLSEQ)
+         memset(r->v_qual + lqual, 0, fLSEQ - lqual);
+   }
+   if (fColumns & kOPT)
+      ReadOPT(entry, r);
+   return nbytes;
+}
+
+inline Int_t RAMColumns::ReadBatch(Long64_t first, Int_t n, UInt_t columns, RAMBatch &batch)
+{
+   // Read the fixed size columns (kFLAG, kREFID, kPOS, kMAPQ, kREFNEXT, kPNEXT
+   // and kTLEN) of the n entries starting at first into the arrays of batch,
+   // in bulk, without going through a RAMRecord. With kCIGAR fills the
+   // alignment ends, with kSEQ the SEQ lengths, these are read per entry.
+   // The columns read by Read() are not changed. Returns the number of
+   // entries read, less than n at the end of the tree.
+
+   n = (Int_t) std::max(std::min((Long64_t) n, fTree->GetEntries() - first), 0LL);
+   batch.Resize(first, n, columns);
+   if (n == 0)
+      return 0;
+
+   if (columns & kFLAG)
+      ReadBulk("flag", first, n, batch.fFLAG.data(), fFLAG);
+   if (columns & kREFID)
+      ReadBulk("refid", first, n, batch.fREFID.data(), fREFID);
+   if (columns & kMAPQ)
+      ReadBulk("mapq", first, n, batch.fMAPQ.data(), fMAPQ);
+   if (columns & kREFNEXT)
+      ReadBulk("refnext", first, n, batch.fREFNEXT.data(), fREFNEXT);
+   if (columns & kPNEXT)
+      ReadBulk("pnext", first, n, batch.fPNEXT.data(), fPNEXT);
+   if (columns & kTLEN)
+      ReadBulk("tlen", first, n, batch.fTLEN.data(), fTLEN);
+   if (columns & kSEQ)
+      ReadBulk("lseq", first, n, batch.fLSEQ.data(), fLSEQ);
+
+   if (columns & (kPOS | kCIGAR)) {
+      // the deltas from the start of the block of first, then decoded in place
+      Long64_t start = BlockStart(first);
+      std::vector<Int_t> &pos = fBatchPOS;
+      pos.resize(first + n - start);
+      ReadBulk("pos", start, pos.size(), pos.data(), fPOS);
+      Long64_t next = start;
+      for (Long64_t j = start; j < first + n; j++) {
+         Int_t &p = pos[j - start];
+         if (j == next)
+            next = NextBlockStart(j);
+         else
+            p = (Int_t) ((UInt_t) pos[j - start - 1] + (UInt_t) p);
+      }
+      pos.erase(pos.begin(), pos.begin() + (first - start));
+      fBatchFirst = first;
+      memcpy(batch.fPOS.data(), pos.data(), n * sizeof(Int_t));
+   }
+
+   if (columns & kCIGAR) {
+      TBranch *bn = fTree->GetBranch("ncigar"), *bc = fTree->GetBranch("cigar");
+      for (Int_t i = 0; i < n; i++) {
+         bn->GetEntry(first + i, 1);
+         Reserve(fCIGAR, std::max(fNCIGAR, 0), "cigar");
+         bc->GetEntry(first + i, 1);
+         batch.fEND[i] = batch.fPOS[i] + RAMRecord::GetSpan(fCIGAR.data(), std::max(fNCIGAR, 0));
+      }
+   }
+   return n;
+}
+
+inline void RAMColumns::ReadOPT(Long64_t entry, RAMRecord *r)
+{
+   // Set the optional fields of r, in the order of the layout, from the tag
+   // columns and opt.
+
+   r->ResetNOPT();
+   const char *p = fOPT.data();
+   auto text = [&p, r, this]() {
+      // next field of opt
+      const char *tab = strchr(p, '\t');
+      Int_t len = tab ? tab - p : strlen(p);
+      if (len >= 2 && IsTagRead(p))
+         r->SetOPT(p, len);
+      p += len + (tab ? 1 : 0);
+   };
+   if (!fTagColumns) {
+      while (*p)
+         text();
+      return;
+   }
+
+   const char *layout = fTagLayout.data();
+   if (!fTagFilter.empty()) {
+      // with selected tags opt is only read when it has one of them
+      bool intext = false;
+      for (size_t i = 0, n = strlen(layout); i + 2 < n && !intext; i += layout[i] == '.' ? 3 : 2)
+         intext = layout[i] == '.' && IsTagRead(layout + i + 1);
+      if (!intext)
+         p = "";
+      else if (fTree->GetBranch("opt")->GetEntry(entry, 1) <= 0)
+         ::Error("RAMColumns::ReadOPT", "cannot read the optional fields of entry %lld", entry);
+   }
+   for (const char *l = layout; *l; ) {
+      if (*l == '.') {
+         if (*p)
+            text();
+         l += l[1] && l[2] ? 3 : 1;
+         continue;
+      }
+      if (!l[1])
+         break;
+      Int_t t = TagColumn(l);
+      if (t >= 0 && IsTagRead(l)) {
+         char buf[32];
+         if (TagType(t) == 'i') {
+            snprintf(buf, sizeof(buf), "%c%c:i:%d", l[0], l[1], fTagInt[t]);
+            fTagText = buf;
+         } else {
+            fTagText.assign(l, 2);
+            fTagText += ":Z:";
+            fTagText += TagType(t) == 'd' ? fTagValues[t].GetRefName(fTagInt[t]) : fTagStr[t].data();
+         }
+         r->SetOPT(fTagText.data(), fTagText.size());
+      }
+      l += 2;
+   }
+}
+
+#endif
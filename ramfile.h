@@ -0,0 +1,257 @@
+//
+// RAMFile is the reader context of a RAM file: it opens the file and owns
+// the RAM tree, the refs and the indices read from it. Unlike the static
+// refs and indices of RAMRecord, which are used when writing and by
+// RAMRecord::GetTree(), every RAMFile has its own, so several RAM files can
+// be open at the same time. The refs are not changed after opening and can
+// be shared by threads, e.g. the slots of an RDataFrame or the tasks of a
+// TTreeProcessorMT scanning the file. The index partitions are read from
+// the file on first use, like the tree a RAMFile is used by one thread at
+// a time, other threads open their own RAMFile. Records are read with
+// GetEntry() into GetRecord(), from the RAMRecord branch of version 1 files
+// or the flat columns of version 2 files, see RAMColumns. Scans over the
+// fixed size columns use GetBatch() to read them as arrays, see RAMBatch,
+// and skip the clusters that cannot match their filter, see RAMZoneMap.
+//
+
+#ifndef RAMFile_h
+#define RAMFile_h
+
+#include <TFile.h>
+#include <TTree.h>
+#include <TList.h>
+#include <cstring>
+#include <vector>
+
+#include "ramrecord.h"
+#include "ramcolumns.h"
+
+
+class RAMFile {
+private:
+   TFile       *fFile;        // the RAM file
+   TTree       *fTree;        // RAM tree
+   RAMRefs     *fRnameRefs;   // refs of RNAME and RNEXT
+   RAMRefs     *fRnextRefs;   // separate refs of RNEXT of older files, or 0
+   RAMIndex    *fIndex;       // sampled (refid,pos) index, 0 if none
+   RAMBinIndex *fBinIndex;    // binned overlap index, 0 if none
+   RAMZoneMap  *fZoneMap;     // per cluster statistics, 0 if none
+   RAMRecord   *fRecord;      // record read by GetEntry()
+   RAMColumns  *fColumns;     // columns of version 2 files, 0 for version 1
+   UInt_t       fReadColumns; // columns read by GetEntry(), see SetColumns()
+
+   RAMFile(const RAMFile &) = delete;
+   RAMFile &operator=(const RAMFile &) = delete;
+
+public:
+   RAMFile(const char *file, const char *treeName = "RAM");
+   ~RAMFile() { Close(); }
+
+   bool         IsOpen() const { return fTree != nullptr; }
+   TFile       *GetFile() const { return fFile; }
+   TTree       *GetTree() const { return fTree; }
+   TList       *GetHeaders() const;
+   const RAMRefs *GetRnameRefs() const { return fRnameRefs; }
+   const RAMRefs *GetRnextRefs() const { return fRnextRefs; }
+   RAMIndex    *GetIndex() const { return fIndex; }
+   RAMBinIndex *GetBinIndex() const { return fBinIndex; }
+   const RAMZoneMap *GetZoneMap() const { return fZoneMap; }
+   Int_t        GetVersion() const { return fColumns ? 2 : 1; }
+   const RAMColumns *GetColumns() const { return fColumns; }
+
+   RAMRecord   *GetRecord() const { return fRecord; }
+   Long64_t     GetEntries() const { return fTree ? fTree->GetEntries() : 0; }
+   Int_t        GetEntry(Long64_t entry);
+   Int_t        GetBatch(Long64_t first, Int_t n, UInt_t columns, RAMBatch &batch);
+   void         SetColumns(UInt_t columns, const char *tags = nullptr);
+
+   Int_t        GetRefId(const char *rname) const { return GetRefId(rname, strlen(rname)); }
+   Int_t        GetRefId(const char *rname, Int_t len) const;
+   const char  *GetRefName(Int_t refid) const;
+   Int_t        GetRefLength(Int_t refid) const { return fRnameRefs ? fRnameRefs->GetRefLength(refid) : 0; }
+   const char  *GetRNAME(const RAMRecord *r) const { return GetRefName(r->GetREFID()); }
+   const char  *GetRNEXT(const RAMRecord *r) const;
+
+   void         Close();
+};
+
+
+inline RAMFile::RAMFile(const char *file, const char *treeName)
+   : fFile(nullptr), fTree(nullptr), fRnameRefs(nullptr), fRnextRefs(nullptr), fIndex(nullptr),
+     fBinIndex(nullptr), fZoneMap(nullptr), fRecord(nullptr), fColumns(nullptr), fReadColumns(RAMColumns::kAll)
+{
+   // Open file and read the RAM tree, the refs and the index headers. Use
+   // IsOpen() to check for success.
+
+   fFile = TFile::Open(file);
+   if (!fFile || fFile->IsZombie()) {
+      ::Error("RAMFile::RAMFile", "cannot open file %s", file);
+      delete fFile;
+      fFile = nullptr;
+      return;
+   }
+   fFile->GetObject(treeName, fTree);
+   if (!fTree) {
+      ::Error("RAMFile::RAMFile", "file %s has no RAM tree %s", file, treeName);
+      return;
+   }
+
+   fFile->GetObject("RnameRefs", fRnameRefs);
+   fFile->GetObject("RnextRefs", fRnextRefs);
+   if (!fRnameRefs)
+      fRnameRefs = new RAMRefs;
+   fRnameRefs->Rehash();
+   fIndex    = RAMIndex::Read(fFile);
+   fBinIndex = RAMBinIndex::Read(fFile);
+   fZoneMap  = RAMZoneMap::Read(fFile);
+
+   fRecord = new RAMRecord;
+   if (RAMColumns::IsColumnar(fTree)) {
+      fColumns = new RAMColumns;
+      fColumns->Connect(fTree, fFile);
+   } else
+      fTree->SetBranchAddress("RAMRecord.", &fRecord);
+}
+
+inline TList *RAMFile::GetHeaders() const
+{
+   // Return the SAM header lines, see RAMWriter::AddHeader().
+
+   return fTree ? (TList *) fTree->GetUserInfo()->FindObject("headers") : nullptr;
+}
+
+inline Int_t RAMFile::GetEntry(Long64_t entry)
+{
+   // Read entry into GetRecord(). Returns the number of bytes read, 0 when
+   // entry does not exist.
+
+   return fColumns ? fColumns->Read(entry, fRecord) : fTree->GetEntry(entry);
+}
+
+inline Int_t RAMFile::GetBatch(Long64_t first, Int_t n, UInt_t columns, RAMBatch &batch)
+{
+   // Read the given fixed size columns of the n entries starting at first
+   // into batch, see RAMColumns::ReadBatch(). Version 1 files are read
+   // entry by entry. GetRecord() and the columns read by GetEntry() are
+   // not changed. Returns the number of entries read.
+
+   if (fColumns)
+      return fColumns->ReadBatch(first, n, columns, batch);
+
+   n = (Int_t) std::max(std::min((Long64_t) n, GetEntries() - first), 0LL);
+   batch.Resize(first, n, columns);
+   if (n == 0)
+      return 0;
+   UInt_t read = fReadColumns;
+   RAMRecord saved;
+   saved.Swap(*fRecord);
+   SetColumns(columns);
+   for (Int_t i = 0; i < n; i++) {
+      fTree->GetEntry(first + i);
+      if (columns & RAMColumns::kFLAG)
+         batch.fFLAG[i] = fRecord->GetFLAG();
+      if (columns & RAMColumns::kREFID)
+         batch.fREFID[i] = fRecord->GetREFID();
+      if (columns & (RAMColumns::kPOS | RAMColumns::kCIGAR))
+         batch.fPOS[i] = fRecord->GetPOS();
+      if (columns & RAMColumns::kMAPQ)
+         batch.fMAPQ[i] = fRecord->GetMAPQ();
+      if (columns & RAMColumns::kCIGAR)
+         batch.fEND[i] = fRecord->GetEND();
+      if (columns & RAMColumns::kREFNEXT)
+         batch.fREFNEXT[i] = fRecord->GetREFNEXT();
+      if (columns & RAMColumns::kPNEXT)
+         batch.fPNEXT[i] = fRecord->GetPNEXT();
+      if (columns & RAMColumns::kTLEN)
+         batch.fTLEN[i] = fRecord->GetTLEN();
+      if (columns & RAMColumns::kSEQ)
+         batch.fLSEQ[i] = fRecord->GetSEQLEN();
+   }
+   SetColumns(read);
+   saved.Swap(*fRecord);
+   return n;
+}
+
+inline void RAMFile::SetColumns(UInt_t columns, const char *tags)
+{
+   // Read only the given columns, RAMColumns::EColumn bits, the other fields
+   // of the record are not changed by GetEntry(). With RAMColumns::kOPT,
+   // tags selects the optional fields read, e.g. "NM RG", see
+   // RAMColumns::SetColumns(). In version 1 files the columns are the
+   // members of the split RAMRecord branch and all optional fields are read.
+
+   fReadColumns = columns;
+   if (fColumns) {
+      fColumns->SetColumns(columns, tags);
+      return;
+   }
+   if (fTree->GetBranch("RAMRecord.")->GetSplitLevel() <= 0)
+      return;
+   if (columns == RAMColumns::kAll) {
+      fTree->SetBranchStatus("RAMRecord.*", 1);
+      return;
+   }
+   static const char *members[] = { "v_qname", "v_flag", "v_refid", "v_pos", "v_mapq", "v_ncigar_op v_cigar",
+                                    "v_refnext", "v_pnext", "v_tlen", "v_lseq v_lseq2 v_seq",
+                                    "v_lseq v_qual TObject.fBits", "v_nopt v_opt" };
+   fTree->SetBranchStatus("RAMRecord.*", 0);
+   for (Int_t i = 0; i < 12; i++) {
+      if (!(columns & BIT(i)))
+         continue;
+      TString names = members[i], name;
+      Ssiz_t from = 0;
+      while (names.Tokenize(name, from, " "))
+         fTree->SetBranchStatus("RAMRecord." + name, 1);
+   }
+}
+
+inline Int_t RAMFile::GetRefId(const char *rname, Int_t len) const
+{
+   // Return the refid of reference rname of len characters, -1 when it is
+   // not in the file.
+
+   return fRnameRefs ? fRnameRefs->FindRefId(rname, len) : -1;
+}
+
+inline const char *RAMFile::GetRefName(Int_t refid) const
+{
+   // Return the name of refid, "*" for unmapped records.
+
+   if (!fRnameRefs || refid < 0 || refid >= (Int_t) fRnameRefs->Size())
+      return "*";
+   return fRnameRefs->GetRefName(refid);
+}
+
+inline const char *RAMFile::GetRNEXT(const RAMRecord *r) const
+{
+   // Return the RNEXT name of r, "=" when it is the same as RNAME.
+
+   if (fRnextRefs)
+      return fRnextRefs->GetRefName(r->GetREFNEXT());
+   if (r->GetREFNEXT() >= 0 && r->GetREFNEXT() == r->GetREFID())
+      return "=";
+   return GetRefName(r->GetREFNEXT());
+}
+
+inline void RAMFile::Close()
+{
+   delete fIndex;
+   delete fBinIndex;
+   delete fZoneMap;
+   delete fColumns;
+   delete fRnameRefs;
+   delete fRnextRefs;
+   delete fFile;   // also deletes fTree
+   delete fRecord;
+   fIndex     = nullptr;
+   fColumns   = nullptr;
+   fRecord    = nullptr;
+   fBinIndex  = nullptr;
+   fZoneMap   = nullptr;
+   fRnameRefs = nullptr;
+   fRnextRefs = nullptr;
+   fFile      = nullptr;
+   fTree      = nullptr;
+}
+
+#endif
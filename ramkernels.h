@@ -0,0 +1,400 @@
+//
+// RAMKernels are the inner loops of the SEQ and QUAL encodings: packing
+// SEQ into 4-bit BAM codes and back, Illumina binning of qualities and the
+// Phred+33 offset shift. Each kernel has a scalar, an SSE4.1 and an AVX2
+// version, the fastest one supported by the CPU is selected at run time.
+// The vector versions give bit for bit the same results as the scalar
+// ones, see kernels_bench.C. Besides single sequences the kernels take
+// batches of records, selecting the version once. Used by RAMRecord and
+// SAMFormatter.
+//
+
+#ifndef RAMKernels_h
+#define RAMKernels_h
+
+#include <Rtypes.h>
+#include <algorithm>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(__CLING__)
+#define RAMKERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+
+class RAMKernels {
+public:
+   enum ELevel { kScalar = 0, kSSE4 = 1, kAVX2 = 2 };
+
+   static constexpr const char *kCodeToSeq = "=ACMGRSVTWYHKDBN";   // base of each 4-bit code
+
+   static ELevel      GetLevel() { return Get().fLevel; }
+   static ELevel      GetMaxLevel();
+   static ELevel      SetLevel(ELevel level);
+   static const char *GetLevelName(ELevel level);
+
+   // SEQ to 4-bit codes, two per byte, the first in the high nibble, and back
+   static void PackSEQ(const char *seq, Int_t len, UChar_t *packed) { Get().fPackSEQ(seq, len, packed); }
+   static void UnpackSEQ(const UChar_t *packed, Int_t len, char *seq) { Get().fUnpackSEQ(packed, len, seq); }
+   // Illumina 8 bin quality of qual - offset, see illumina_binning
+   static void BinQUAL(const UChar_t *qual, Int_t len, UChar_t *out, UChar_t offset) {
+      Get().fBinQUAL(qual, len, out, offset);
+   }
+   // qual + offset, e.g. Phred to Phred+33
+   static void ShiftQUAL(const UChar_t *qual, Int_t len, UChar_t *out, UChar_t offset) {
+      Get().fShiftQUAL(qual, len, out, offset);
+   }
+
+   // The same for the n records of a batch, record i has len[i] bases
+   static void PackSEQ(Int_t n, const char *const *seq, const Int_t *len, UChar_t *const *packed);
+   static void UnpackSEQ(Int_t n, const UChar_t *const *packed, const Int_t *len, char *const *seq);
+   static void BinQUAL(Int_t n, const UChar_t *const *qual, const Int_t *len, UChar_t *const *out, UChar_t offset);
+   static void ShiftQUAL(Int_t n, const UChar_t *const *qual, const Int_t *len, UChar_t *const *out,
+                         UChar_t offset);
+
+private:
+   typedef void (*Pack_t)(const char *, Int_t, UChar_t *);
+   typedef void (*Unpack_t)(const UChar_t *, Int_t, char *);
+   typedef void (*Qual_t)(const UChar_t *, Int_t, UChar_t *, UChar_t);
+
+   struct Functions {
+      ELevel   fLevel;
+      Pack_t   fPackSEQ;
+      Unpack_t fUnpackSEQ;
+      Qual_t   fBinQUAL;
+      Qual_t   fShiftQUAL;
+
+      Functions() { Select(GetMaxLevel()); }
+      void Select(ELevel level);
+   };
+
+   static Functions &Get() { static Functions f; return f; }
+
+   // Scalar versions, also used for the tails of the vector versions
+   struct Tables {
+      UChar_t fCode[256];      // 4-bit code of each base, 0 for unknown characters
+      char    fPair[256][2];   // two bases of each packed byte
+      UChar_t fBin[256];       // Illumina bin of each quality, 40 and above in the last bin
+      Tables();
+   };
+   static const Tables &GetTables() { static const Tables t; return t; }
+
+   static void PackSEQScalar(const char *seq, Int_t len, UChar_t *packed);
+   static void UnpackSEQScalar(const UChar_t *packed, Int_t len, char *seq);
+   static void BinQUALScalar(const UChar_t *qual, Int_t len, UChar_t *out, UChar_t offset);
+   static void ShiftQUALScalar(const UChar_t *qual, Int_t len, UChar_t *out, UChar_t offset);
+
+#ifdef RAMKERNELS_X86
+   static __m128i SeqCodes(__m128i c, __m128i lut4, __m128i lut5);
+   static __m256i SeqCodes(__m256i c, __m256i lut4, __m256i lut5);
+   static void PackSEQSSE4(const char *seq, Int_t len, UChar_t *packed);
+   static void UnpackSEQSSE4(const UChar_t *packed, Int_t len, char *seq);
+   static void BinQUALSSE4(const UChar_t *qual, Int_t len, UChar_t *out, UChar_t offset);
+   static void ShiftQUALSSE4(const UChar_t *qual, Int_t len, UChar_t *out, UChar_t offset);
+   static void PackSEQAVX2(const char *seq, Int_t len, UChar_t *packed);
+   static void UnpackSEQAVX2(const UChar_t *packed, Int_t len, char *seq);
+   static void BinQUALAVX2(const UChar_t *qual, Int_t len, UChar_t *out, UChar_t offset);
+   static void ShiftQUALAVX2(const UChar_t *qual, Int_t len, UChar_t *out, UChar_t offset);
+#endif
+};
+
+
+inline RAMKernels::Tables::Tables()
+{
+   // Thread safe one-time initialization, as function static.
+
+   static const UChar_t bins[] = { 0, 1, 6, 6, 6, 6, 6, 6, 6, 6, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+                                   22, 22, 22, 22, 22, 27, 27, 27, 27, 27, 33, 33, 33, 33, 33,
+                                   37, 37, 37, 37, 37, 40 };
+   memset(fCode, 0, 256);
+   for (int i = 1; i < 16; i++)
+      fCode[(UChar_t)kCodeToSeq[i]] = i;
+   for (int i = 0; i < 256; i++) {
+      fPair[i][0] = kCodeToSeq[i >> 4];
+      fPair[i][1] = kCodeToSeq[i & 0xf];
+      fBin[i]     = bins[std::min(i, 40)];
+   }
+}
+
+inline RAMKernels::ELevel RAMKernels::GetMaxLevel()
+{
+   // Best version supported by the CPU.
+
+#ifdef RAMKERNELS_X86
+   if (__builtin_cpu_supports("avx2"))
+      return kAVX2;
+   if (__builtin_cpu_supports("sse4.1"))
+      return kSSE4;
+#endif
+   return kScalar;
+}
+
+inline RAMKernels::ELevel RAMKernels::SetLevel(ELevel level)
+{
+   // Use the given version of the kernels, or the best supported one below
+   // it, e.g. kScalar to compare. Returns the version used. Not thread
+   // safe, to be called before the kernels are used.
+
+   Get().Select(std::min(level, GetMaxLevel()));
+   return GetLevel();
+}
+
+inline const char *RAMKernels::GetLevelName(ELevel level)
+{
+   switch (level) {
+      case kSSE4: return "SSE4.1";
+      case kAVX2: return "AVX2";
+      default:    return "scalar";
+   }
+}
+
+inline void RAMKernels::Functions::Select(ELevel level)
+{
+   fLevel     = kScalar;
+   fPackSEQ   = PackSEQScalar;
+   fUnpackSEQ = UnpackSEQScalar;
+   fBinQUAL   = BinQUALScalar;
+   fShiftQUAL = ShiftQUALScalar;
+#ifdef RAMKERNELS_X86
+   if (level == kSSE4) {
+      fLevel     = kSSE4;
+      fPackSEQ   = PackSEQSSE4;
+      fUnpackSEQ = UnpackSEQSSE4;
+      fBinQUAL   = BinQUALSSE4;
+      fShiftQUAL = ShiftQUALSSE4;
+   } else if (level == kAVX2) {
+      fLevel     = kAVX2;
+      fPackSEQ   = PackSEQAVX2;
+      fUnpackSEQ = UnpackSEQAVX2;
+      fBinQUAL   = BinQUALAVX2;
+      fShiftQUAL = ShiftQUALAVX2;
+   }
+#endif
+}
+
+inline void RAMKernels::PackSEQ(Int_t n, const char *const *seq, const Int_t *len, UChar_t *const *packed)
+{
+   Pack_t f = Get().fPackSEQ;
+   for (Int_t i = 0; i < n; i++)
+      f(seq[i], len[i], packed[i]);
+}
+
+inline void RAMKernels::UnpackSEQ(Int_t n, const UChar_t *const *packed, const Int_t *len, char *const *seq)
+{
+   Unpack_t f = Get().fUnpackSEQ;
+   for (Int_t i = 0; i < n; i++)
+      f(packed[i], len[i], seq[i]);
+}
+
+inline void RAMKernels::BinQUAL(Int_t n, const UChar_t *const *qual, const Int_t *len, UChar_t *const *out,
+                                UChar_t offset)
+{
+   Qual_t f = Get().fBinQUAL;
+   for (Int_t i = 0; i < n; i++)
+      f(qual[i], len[i], out[i], offset);
+}
+
+inline void RAMKernels::ShiftQUAL(Int_t n, const UChar_t *const *qual, const Int_t *len, UChar_t *const *out,
+                                  UChar_t offset)
+{
+   Qual_t f = Get().fShiftQUAL;
+   for (Int_t i = 0; i < n; i++)
+      f(qual[i], len[i], out[i], offset);
+}
+
+inline void RAMKernels::PackSEQScalar(const char *seq, Int_t len, UChar_t *packed)
+{
+   const UChar_t *code = GetTables().fCode;
+   Int_t j = 0;
+   for (Int_t i = 0; i + 1 < len; i += 2)
+      packed[j++] = (code[(UChar_t)seq[i]] << 4) | code[(UChar_t)seq[i+1]];
+   if (len % 2)
+      packed[j] = code[(UChar_t)seq[len-1]] << 4;
+}
+
+inline void RAMKernels::UnpackSEQScalar(const UChar_t *packed, Int_t len, char *seq)
+{
+   const Tables &t = GetTables();
+   for (Int_t i = 0; i < len / 2; i++)
+      memcpy(seq + 2*i, t.fPair[packed[i]], 2);
+   if (len % 2)
+      seq[len-1] = t.fPair[packed[len / 2]][0];
+}
+
+inline void RAMKernels::BinQUALScalar(const UChar_t *qual, Int_t len, UChar_t *out, UChar_t offset)
+{
+   // Qualities below offset are in the first bin.
+
+   const UChar_t *bin = GetTables().fBin;
+   for (Int_t i = 0; i < len; i++)
+      out[i] = bin[qual[i] > offset ? qual[i] - offset : 0];
+}
+
+inline void RAMKernels::ShiftQUALScalar(const UChar_t *qual, Int_t len, UChar_t *out, UChar_t offset)
+{
+   for (Int_t i = 0; i < len; i++)
+      out[i] = qual[i] + offset;
+}
+
+#ifdef RAMKERNELS_X86
+
+// The bases with a non-zero code are upper case letters, 0x40 to 0x5f, the
+// code of a character is looked up by its low nibble in the table of its
+// high nibble, lut4 or lut5. Pairs of codes are combined as c0*16 + c1 and
+// packed to bytes.
+
+__attribute__((target("sse4.1")))
+inline __m128i RAMKernels::SeqCodes(__m128i c, __m128i lut4, __m128i lut5)
+{
+   const __m128i nib = _mm_set1_epi8(0x0f);
+   __m128i lo = _mm_and_si128(c, nib);
+   __m128i hi = _mm_and_si128(_mm_srli_epi16(c, 4), nib);
+   return _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi8(hi, _mm_set1_epi8(4)), _mm_shuffle_epi8(lut4, lo)),
+                       _mm_and_si128(_mm_cmpeq_epi8(hi, _mm_set1_epi8(5)), _mm_shuffle_epi8(lut5, lo)));
+}
+
+__attribute__((target("sse4.1")))
+inline void RAMKernels::PackSEQSSE4(const char *seq, Int_t len, UChar_t *packed)
+{
+   const UChar_t *code = GetTables().fCode;
+   const __m128i lut4 = _mm_loadu_si128((const __m128i *)(code + 0x40));
+   const __m128i lut5 = _mm_loadu_si128((const __m128i *)(code + 0x50));
+   const __m128i mul  = _mm_set1_epi16(0x0110);
+   Int_t i = 0;
+   for (; i + 32 <= len; i += 32) {
+      __m128i p0 = _mm_maddubs_epi16(SeqCodes(_mm_loadu_si128((const __m128i *)(seq + i)), lut4, lut5), mul);
+      __m128i p1 = _mm_maddubs_epi16(SeqCodes(_mm_loadu_si128((const __m128i *)(seq + i + 16)), lut4, lut5), mul);
+      _mm_storeu_si128((__m128i *)(packed + i / 2), _mm_packus_epi16(p0, p1));
+   }
+   PackSEQScalar(seq + i, len - i, packed + i / 2);
+}
+
+__attribute__((target("sse4.1")))
+inline void RAMKernels::UnpackSEQSSE4(const UChar_t *packed, Int_t len, char *seq)
+{
+   const __m128i lut = _mm_loadu_si128((const __m128i *)kCodeToSeq);
+   const __m128i nib = _mm_set1_epi8(0x0f);
+   Int_t i = 0;
+   for (; i + 32 <= len; i += 32) {
+      __m128i b  = _mm_loadu_si128((const __m128i *)(packed + i / 2));
+      __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(b, 4), nib));
+      __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(b, nib));
+      _mm_storeu_si128((__m128i *)(seq + i),      _mm_unpacklo_epi8(hi, lo));
+      _mm_storeu_si128((__m128i *)(seq + i + 16), _mm_unpackhi_epi8(hi, lo));
+   }
+   UnpackSEQScalar(packed + i / 2, len - i, seq + i);
+}
+
+__attribute__((target("sse4.1")))
+inline void RAMKernels::BinQUALSSE4(const UChar_t *qual, Int_t len, UChar_t *out, UChar_t offset)
+{
+   // The bin is the value of the largest lower bound the quality reaches.
+
+   static const UChar_t bounds[7][2] = { { 2, 6 }, { 10, 15 }, { 20, 22 }, { 25, 27 }, { 30, 33 }, { 35, 37 },
+                                         { 40, 40 } };
+   const __m128i off = _mm_set1_epi8(offset);
+   Int_t i = 0;
+   for (; i + 16 <= len; i += 16) {
+      __m128i q = _mm_subs_epu8(_mm_loadu_si128((const __m128i *)(qual + i)), off);
+      __m128i r = q;
+      for (auto &b : bounds) {
+         __m128i reached = _mm_cmpeq_epi8(_mm_max_epu8(q, _mm_set1_epi8(b[0])), q);
+         r = _mm_blendv_epi8(r, _mm_set1_epi8(b[1]), reached);
+      }
+      _mm_storeu_si128((__m128i *)(out + i), r);
+   }
+   BinQUALScalar(qual + i, len - i, out + i, offset);
+}
+
+__attribute__((target("sse4.1")))
+inline void RAMKernels::ShiftQUALSSE4(const UChar_t *qual, Int_t len, UChar_t *out, UChar_t offset)
+{
+   const __m128i off = _mm_set1_epi8(offset);
+   Int_t i = 0;
+   for (; i + 16 <= len; i += 16)
+      _mm_storeu_si128((__m128i *)(out + i), _mm_add_epi8(_mm_loadu_si128((const __m128i *)(qual + i)), off));
+   ShiftQUALScalar(qual + i, len - i, out + i, offset);
+}
+
+// The AVX2 versions work on the two 128-bit lanes like the SSE4.1 ones, the
+// lane crossing packs and unpacks are put back in order with permutes.
+
+__attribute__((target("avx2")))
+inline __m256i RAMKernels::SeqCodes(__m256i c, __m256i lut4, __m256i lut5)
+{
+   const __m256i nib = _mm256_set1_epi8(0x0f);
+   __m256i lo = _mm256_and_si256(c, nib);
+   __m256i hi = _mm256_and_si256(_mm256_srli_epi16(c, 4), nib);
+   return _mm256_or_si256(_mm256_and_si256(_mm256_cmpeq_epi8(hi, _mm256_set1_epi8(4)), _mm256_shuffle_epi8(lut4, lo)),
+                          _mm256_and_si256(_mm256_cmpeq_epi8(hi, _mm256_set1_epi8(5)), _mm256_shuffle_epi8(lut5, lo)));
+}
+
+__attribute__((target("avx2")))
+inline void RAMKernels::PackSEQAVX2(const char *seq, Int_t len, UChar_t *packed)
+{
+   const UChar_t *code = GetTables().fCode;
+   const __m256i lut4 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(code + 0x40)));
+   const __m256i lut5 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(code + 0x50)));
+   const __m256i mul  = _mm256_set1_epi16(0x0110);
+   Int_t i = 0;
+   for (; i + 64 <= len; i += 64) {
+      __m256i p0 = _mm256_maddubs_epi16(SeqCodes(_mm256_loadu_si256((const __m256i *)(seq + i)), lut4, lut5), mul);
+      __m256i p1 = _mm256_maddubs_epi16(SeqCodes(_mm256_loadu_si256((const __m256i *)(seq + i + 32)), lut4, lut5),
+                                        mul);
+      __m256i p  = _mm256_permute4x64_epi64(_mm256_packus_epi16(p0, p1), 0xd8);
+      _mm256_storeu_si256((__m256i *)(packed + i / 2), p);
+   }
+   PackSEQSSE4(seq + i, len - i, packed + i / 2);
+}
+
+__attribute__((target("avx2")))
+inline void RAMKernels::UnpackSEQAVX2(const UChar_t *packed, Int_t len, char *seq)
+{
+   const __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)kCodeToSeq));
+   const __m256i nib = _mm256_set1_epi8(0x0f);
+   Int_t i = 0;
+   for (; i + 64 <= len; i += 64) {
+      __m256i b  = _mm256_loadu_si256((const __m256i *)(packed + i / 2));
+      __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(b, 4), nib));
+      __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(b, nib));
+      __m256i s0 = _mm256_unpacklo_epi8(hi, lo);
+      __m256i s1 = _mm256_unpackhi_epi8(hi, lo);
+      _mm256_storeu_si256((__m256i *)(seq + i),      _mm256_permute2x128_si256(s0, s1, 0x20));
+      _mm256_storeu_si256((__m256i *)(seq + i + 32), _mm256_permute2x128_si256(s0, s1, 0x31));
+   }
+   UnpackSEQSSE4(packed + i / 2, len - i, seq + i);
+}
+
+__attribute__((target("avx2")))
+inline void RAMKernels::BinQUALAVX2(const UChar_t *qual, Int_t len, UChar_t *out, UChar_t offset)
+{
+   static const UChar_t bounds[7][2] = { { 2, 6 }, { 10, 15 }, { 20, 22 }, { 25, 27 }, { 30, 33 }, { 35, 37 },
+                                         { 40, 40 } };
+   const __m256i off = _mm256_set1_epi8(offset);
+   Int_t i = 0;
+   for (; i + 32 <= len; i += 32) {
+      __m256i q = _mm256_subs_epu8(_mm256_loadu_si256((const __m256i *)(qual + i)), off);
+      __m256i r = q;
+      for (auto &b : bounds) {
+         __m256i reached = _mm256_cmpeq_epi8(_mm256_max_epu8(q, _mm256_set1_epi8(b[0])), q);
+         r = _mm256_blendv_epi8(r, _mm256_set1_epi8(b[1]), reached);
+      }
+      _mm256_storeu_si256((__m256i *)(out + i), r);
+   }
+   BinQUALSSE4(qual + i, len - i, out + i, offset);
+}
+
+__attribute__((target("avx2")))
+inline void RAMKernels::ShiftQUALAVX2(const UChar_t *qual, Int_t len, UChar_t *out, UChar_t offset)
+{
+   const __m256i off = _mm256_set1_epi8(offset);
+   Int_t i = 0;
+   for (; i + 32 <= len; i += 32)
+      _mm256_storeu_si256((__m256i *)(out + i),
+                          _mm256_add_epi8(_mm256_loadu_si256((const __m256i *)(qual + i)), off));
+   ShiftQUALSSE4(qual + i, len - i, out + i, offset);
+}
+
+#endif
+
+#endif
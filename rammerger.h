@@ -0,0 +1,312 @@
+//
+// RAMMerger merges coordinate sorted RAM files into a RAMWriter with a
+// k-way merge on (refid,pos). The refs of the inputs are entered in the
+// refs of the output and the refids of the records are remapped. Only one
+// record and a TTreeCache per input are kept in memory. Runs of records of
+// an input that sort before the other inputs are copied a tree cluster at a
+// time in compressed form, see RAMWriter::CopyCluster(). Used by rammerge
+// and by ramsort to merge its sorted runs.
+//
+
+#ifndef RAMMerger_h
+#define RAMMerger_h
+
+#include <TFile.h>
+#include <TTree.h>
+#include <TList.h>
+#include <TNamed.h>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "ramrecord.h"
+#include "ramfile.h"
+#include "ramwriter.h"
+
+
+class RAMMerger {
+private:
+   // An input of the merge, read one record at a time.
+   struct Input {
+      RAMFile             *fFile;
+      RAMRecord           *fRecord;     // current record, owned by fFile
+      Long64_t             fEntry;      // entry of fRecord
+      Long64_t             fEntries;
+      ULong64_t            fKey;        // (refid,pos) key of fRecord
+      std::vector<Int_t>   fRnameMap;   // input refid to output refid
+      std::vector<Int_t>   fRnextMap;   // input refnext to output refid, kSameRef for "="
+      bool                 fIdentity;   // the maps are the identity
+      bool                 fCopy;       // clusters can be copied to the output
+   };
+
+   std::vector<Input> fInputs;
+   Long64_t           fCacheSize;   // TTreeCache size per input
+   Long64_t           fCopied;      // records copied in compressed form
+
+   static ULong64_t Key(const RAMRecord *r, const Input &in);
+   static bool      Next(Input &in);
+   static void      Unsorted(const Input &in, Long64_t entry);
+
+public:
+   static const Int_t kSameRef = -2;   // RNEXT "=" in the separate RNEXT refs of older files
+
+   static bool MapRefs(const RAMRefs *refs, RAMRefs *outrefs, std::vector<Int_t> &map);
+
+   RAMMerger(Long64_t cachesize = 10000000) : fCacheSize(cachesize), fCopied(0) { }
+   ~RAMMerger() { Close(); }
+
+   bool     AddFile(const char *file);
+   void     MergeHeaders(RAMWriter &writer);
+   Long64_t Merge(RAMWriter &writer, bool fast = true);
+   void     Close();
+
+   size_t   GetNFiles() const { return fInputs.size(); }
+   UInt_t   GetQualityPolicy() const;
+   const char *GetCompression() const;
+   Long64_t GetCopied() const { return fCopied; }
+   Long64_t GetBytesRead() const;
+};
+
+
+inline ULong64_t RAMMerger::Key(const RAMRecord *r, const Input &in)
+{
+   // Sort key in output refids. Unmapped records (refid -1) sort last.
+
+   Int_t refid = r->GetREFID() < 0 ? -1 : in.fRnameMap[r->GetREFID()];
+   return ((ULong64_t) (UInt_t) refid << 32) | (UInt_t) (r->GetPOS() + 1);
+}
+
+inline bool RAMMerger::Next(Input &in)
+{
+   // Read the record at in.fEntry and update the key. Returns false when it
+   // sorts before the previous record.
+
+   in.fFile->GetEntry(in.fEntry);
+   ULong64_t key = Key(in.fRecord, in);
+   if (key < in.fKey) {
+      Unsorted(in, in.fEntry);
+      return false;
+   }
+   in.fKey = key;
+   return true;
+}
+
+inline void RAMMerger::Unsorted(const Input &in, Long64_t entry)
+{
+   ::Error("RAMMerger::Merge", "file %s is not coordinate sorted at entry %lld, or its references "
+           "are in a different order", in.fFile->GetFile()->GetName(), entry);
+}
+
+inline bool RAMMerger::MapRefs(const RAMRefs *refs, RAMRefs *outrefs, std::vector<Int_t> &map)
+{
+   // Enter the refs of an input, with their lengths, in the output refs and
+   // fill map with the output refid of each input refid. Returns true when
+   // the map is the identity.
+
+   bool identity = true;
+   map.resize(refs ? refs->Size() : 0);
+   for (size_t i = 0; i < map.size(); i++) {
+      if (!strcmp(refs->GetRefName(i), "=")) {
+         map[i] = kSameRef;
+         identity = false;
+         continue;
+      }
+      map[i] = outrefs->GetRefId(refs->GetRefName(i));
+      if (refs->GetRefLength(i) > 0)
+         outrefs->SetRefLength(map[i], refs->GetRefLength(i));
+      identity &= map[i] == (Int_t) i;
+   }
+   return identity;
+}
+
+inline bool RAMMerger::AddFile(const char *file)
+{
+   // Add a coordinate sorted RAM file to the merge. Every input must list
+   // the references it shares with the previous inputs in the same order.
+   // The refs are mapped onto the output refs by Merge(), so all inputs can
+   // be opened, and checked, before the output is created.
+
+   Input in = { new RAMFile(file), nullptr, 0, 0, 0, {}, {}, false, false };
+   if (!in.fFile->IsOpen()) {
+      ::Error("RAMMerger::AddFile", "file %s, not found or not a RAM file", file);
+      delete in.fFile;
+      return false;
+   }
+
+   in.fRecord  = in.fFile->GetRecord();
+   in.fEntries = in.fFile->GetEntries();
+   in.fFile->GetTree()->SetCacheSize(fCacheSize);
+   fInputs.push_back(in);
+   return true;
+}
+
+inline UInt_t RAMMerger::GetQualityPolicy() const
+{
+   // Quality policy of the first input, for the output. Version 1 files
+   // have none, the policy of their first record is returned.
+
+   if (fInputs.empty())
+      return RAMRecord::kPhred33;
+   RAMFile *f = fInputs[0].fFile;
+   if (f->GetColumns())
+      return f->GetColumns()->GetQualityPolicy();
+   UInt_t policy = 0;
+   if (f->GetEntries() > 0 && f->GetEntry(0) > 0)
+      policy = f->GetRecord()->TestBits(RAMRecord::kPhred33 | RAMRecord::kIlluminaBinning | RAMRecord::kDrop);
+   return policy ? policy : (UInt_t) RAMRecord::kPhred33;
+}
+
+inline const char *RAMMerger::GetCompression() const
+{
+   // Column compression spec for the output, qname=tokenize when the QNAME
+   // of the first input is coded with the name codec, so its clusters can
+   // be copied.
+
+   if (fInputs.empty() || !fInputs[0].fFile->GetColumns())
+      return nullptr;
+   return fInputs[0].fFile->GetColumns()->HasNameCodec() ? "qname=tokenize" : nullptr;
+}
+
+inline void RAMMerger::MergeHeaders(RAMWriter &writer)
+{
+   // Copy the SAM headers of the first input to writer, the other inputs
+   // add the lines (e.g. @RG and @PG) not present yet, except @HD.
+
+   std::vector<std::string> headers;
+   for (auto &in : fInputs) {
+      TList *hl = in.fFile->GetHeaders();
+      TIter next(hl);
+      while (TNamed *h = (TNamed *) next()) {
+         std::string line = std::string(h->GetName()) + "\t" + h->GetTitle();
+         if (&in != &fInputs[0] && (!strcmp(h->GetName(), "@HD") ||
+             std::find(headers.begin(), headers.end(), line) != headers.end()))
+            continue;
+         headers.push_back(line);
+         writer.AddHeader(h->GetTitle()[0] ? std::string_view(line) : std::string_view(h->GetName()));
+      }
+   }
+}
+
+inline Long64_t RAMMerger::Merge(RAMWriter &writer, bool fast)
+{
+   // Merge the inputs into writer, the inputs can be of either version. With
+   // fast, a tree cluster of an input whose refs map onto the output
+   // unchanged, and that sorts completely before the current records of the
+   // other inputs, is copied in compressed form when writer accepts it, see
+   // RAMWriter::CopyCluster(). Version 1 inputs are only copied as a whole.
+   // The order of the records of a copied cluster is checked by the writer,
+   // while it indexes them. Returns the number of records merged, or -1
+   // when an input is not coordinate sorted, writer is then incomplete.
+
+   // Heap of (key,input) of the current record of each input
+   typedef std::pair<ULong64_t, size_t> Item_t;
+   std::priority_queue<Item_t, std::vector<Item_t>, std::greater<Item_t>> heap;
+   for (size_t k = 0; k < fInputs.size(); k++) {
+      Input &in = fInputs[k];
+      // Older files have separate RNEXT refs, which are merged in the output refs
+      in.fIdentity = MapRefs(in.fFile->GetRnameRefs(), writer.GetRnameRefs(), in.fRnameMap);
+      if (in.fFile->GetRnextRefs())
+         in.fIdentity &= MapRefs(in.fFile->GetRnextRefs(), writer.GetRnameRefs(), in.fRnextMap);
+      else
+         in.fRnextMap = in.fRnameMap;
+      if (in.fEntries == 0)
+         continue;
+      in.fCopy = fast && in.fIdentity && writer.CanCopy(*in.fFile);
+      in.fFile->GetEntry(0);
+      in.fKey = Key(in.fRecord, in);
+      heap.push(Item_t(in.fKey, k));
+   }
+
+   RAMRecord *r = writer.GetRecord();
+   Long64_t nrecords = 0;
+
+   while (!heap.empty()) {
+      size_t k = heap.top().second;
+      heap.pop();
+      Input &in = fInputs[k];
+      ULong64_t limit = heap.empty() ? ~0ULL : heap.top().first;
+      size_t    other = heap.empty() ? 0 : heap.top().second;
+
+      // The part of the input copied at once: the cluster of the current
+      // record, or the whole tree of version 1 files
+      Long64_t start = 0, end = in.fEntries;
+      if (in.fCopy && in.fFile->GetVersion() >= 2) {
+         auto it = in.fFile->GetTree()->GetClusterIterator(in.fEntry);
+         start = it();
+         end   = std::min(it.GetNextEntry(), in.fEntries);
+      }
+
+      // Fast path: a cluster that starts at the current record and whose
+      // last record sorts before the current records of the other inputs
+      if (in.fCopy && start == in.fEntry) {
+         in.fFile->SetColumns(RAMColumns::kREFID | RAMColumns::kPOS);
+         in.fFile->GetEntry(end - 1);
+         in.fFile->SetColumns(RAMColumns::kAll);
+         ULong64_t last = Key(in.fRecord, in);
+         if (last >= in.fKey && (last < limit || (last == limit && k < other)) &&
+             writer.CopyCluster(*in.fFile, start, end)) {
+            if (writer.GetUnsortedCopy() >= 0) {
+               Unsorted(in, writer.GetUnsortedCopy());
+               return -1;
+            }
+            fCopied  += end - start;
+            nrecords += end - start;
+            in.fEntry = end;
+            in.fKey   = last;
+            if (in.fEntry == in.fEntries)
+               continue;
+            if (!Next(in))
+               return -1;
+            heap.push(Item_t(in.fKey, k));
+            continue;
+         }
+         in.fFile->GetEntry(in.fEntry);
+      }
+
+      // Copy records of this input as long as they sort before the next
+      // record of the other inputs, up to the end of the cluster when it
+      // may be copied from there on
+      while (true) {
+         r->Swap(*in.fRecord);
+         if (r->GetREFID() >= 0)
+            r->SetREFID(in.fRnameMap[r->GetREFID()]);
+         if (r->GetREFNEXT() >= 0) {
+            Int_t refnext = in.fRnextMap[r->GetREFNEXT()];
+            r->SetREFNEXT(refnext == kSameRef ? r->GetREFID() : refnext);
+         }
+         writer.Fill();
+         nrecords++;
+
+         if (++in.fEntry == in.fEntries)
+            break;
+         if (!Next(in))
+            return -1;
+         if (in.fKey > limit || (in.fKey == limit && k > other) || in.fEntry == end) {
+            heap.push(Item_t(in.fKey, k));
+            break;
+         }
+      }
+   }
+   return nrecords;
+}
+
+inline Long64_t RAMMerger::GetBytesRead() const
+{
+   Long64_t nbytes = 0;
+   for (auto &in : fInputs)
+      nbytes += in.fFile->GetFile()->GetBytesRead();
+   return nbytes;
+}
+
+inline void RAMMerger::Close()
+{
+   for (auto &in : fInputs) {
+      delete in.fFile;   // also deletes the tree and the record
+   }
+   fInputs.clear();
+}
+
+#endif
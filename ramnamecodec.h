@@ -0,0 +1,252 @@
+//
+// RAMNameCodec codes the QNAME of a block of records at once, selected
+// with qname=tokenize in the column compression spec. A name is split in
+// tokens, runs of digits and runs of other characters, and each token is
+// coded against the token at the same position of the previous name of the
+// block: equal, a small increment of a number, a number or a string. The
+// operations and values of each token position are kept in separate
+// streams, in the spirit of the name tokenizer of CRAM 3.1, so the
+// compression of the column sees long repeats and few distinct bytes.
+// Used by RAMColumns for version 2 files.
+//
+
+#ifndef RAMNameCodec_h
+#define RAMNameCodec_h
+
+#include <Rtypes.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+
+class RAMNameCodec {
+private:
+   static const Int_t kMaxTokens = 32;   // the rest of a name is one string token
+   static const Int_t kMaxDigits = 18;   // longer numbers are string tokens
+
+   // Operation coding a token, and the streams of a token position
+   enum EOp { kMatch, kDelta, kNumber, kString };
+   enum EStream { kOps, kDeltas, kNumbers, kStrings, kNStreams };
+
+   // A token of the previous or current name.
+   struct Token {
+      Int_t      fStart;   // offset in the name, or in the decoded names
+      Int_t      fLen;
+      bool       fNum;     // a number, without leading zeros
+      ULong64_t  fValue;
+   };
+
+   std::vector<std::vector<UChar_t>> fStreams;   // name codes, then kNStreams per token position
+   std::vector<Token>                fPrev;      // tokens of the previous name
+   std::vector<Token>                fCur;
+
+   static void  Tokenize(const char *name, Int_t len, std::vector<Token> &tokens);
+   static void  PutVarint(std::vector<UChar_t> &out, ULong64_t v);
+   static bool  GetVarint(const UChar_t *&in, const UChar_t *end, ULong64_t &v);
+
+public:
+   void Encode(const char *names, const std::vector<Int_t> &lens, std::vector<UChar_t> &out);
+   bool Decode(const UChar_t *in, Int_t nin, std::vector<char> &names, std::vector<Int_t> &offsets);
+};
+
+
+inline void RAMNameCodec::Tokenize(const char *name, Int_t len, std::vector<Token> &tokens)
+{
+   // Split name in runs of digits and runs of other characters, the last
+   // token position takes the rest of the name. A run of digits is a number
+   // when it prints back the same.
+
+   tokens.clear();
+   for (Int_t i = 0; i < len;) {
+      bool digits = name[i] >= '0' && name[i] <= '9';
+      bool last   = (Int_t) tokens.size() == kMaxTokens - 1;
+      Int_t j = i;
+      if (last)
+         j = len;
+      else
+         while (j < len && (name[j] >= '0' && name[j] <= '9') == digits)
+            j++;
+      Token t = { i, j - i, !last && digits && j - i <= kMaxDigits && (name[i] != '0' || j - i == 1), 0 };
+      for (Int_t k = i; t.fNum && k < j; k++)
+         t.fValue = 10 * t.fValue + (name[k] - '0');
+      tokens.push_back(t);
+      i = j;
+   }
+}
+
+inline void RAMNameCodec::PutVarint(std::vector<UChar_t> &out, ULong64_t v)
+{
+   while (v >= 0x80) {
+      out.push_back(v | 0x80);
+      v >>= 7;
+   }
+   out.push_back(v);
+}
+
+inline bool RAMNameCodec::GetVarint(const UChar_t *&in, const UChar_t *end, ULong64_t &v)
+{
+   v = 0;
+   for (Int_t shift = 0; in < end && shift < 64; shift += 7) {
+      UChar_t c = *in++;
+      v |= (ULong64_t) (c & 0x7f) << shift;
+      if (!(c & 0x80))
+         return true;
+   }
+   return false;
+}
+
+inline void RAMNameCodec::Encode(const char *names, const std::vector<Int_t> &lens, std::vector<UChar_t> &out)
+{
+   // Encode the names of a block of records, names holds the name of record
+   // i, lens[i] characters, one after the other. The block is appended to
+   // out: the number of records, the number and sizes of the streams and
+   // the streams. Stream 0 has per name 0 when it equals the previous name,
+   // else its number of tokens + 1, followed by the streams of the token
+   // positions: the operations, the increments, the numbers and the
+   // strings.
+
+   for (auto &s : fStreams)
+      s.clear();
+   fStreams.resize(1);
+   fPrev.clear();
+   const char *prev = names, *name = names;
+   Int_t lprev = 0;
+
+   for (auto len : lens) {
+      if (name != names && len == lprev && !memcmp(name, prev, len)) {
+         fStreams[0].push_back(0);
+         prev  = name;
+         name += len;
+         continue;
+      }
+      Tokenize(name, len, fCur);
+      PutVarint(fStreams[0], fCur.size() + 1);
+      if (fStreams.size() < 1 + kNStreams * fCur.size())
+         fStreams.resize(1 + kNStreams * fCur.size());
+      for (size_t t = 0; t < fCur.size(); t++) {
+         const Token &c = fCur[t];
+         std::vector<UChar_t> *s = &fStreams[1 + kNStreams * t];
+         const Token *p = t < fPrev.size() ? &fPrev[t] : nullptr;
+         if (p && p->fLen == c.fLen && !memcmp(prev + p->fStart, name + c.fStart, c.fLen)) {
+            s[kOps].push_back(kMatch);
+         } else if (p && c.fNum && p->fNum && c.fValue > p->fValue && c.fValue - p->fValue < 256) {
+            s[kOps].push_back(kDelta);
+            s[kDeltas].push_back(c.fValue - p->fValue);
+         } else if (c.fNum) {
+            s[kOps].push_back(kNumber);
+            PutVarint(s[kNumbers], c.fValue);
+         } else {
+            s[kOps].push_back(kString);
+            PutVarint(s[kStrings], c.fLen);
+            s[kStrings].insert(s[kStrings].end(), name + c.fStart, name + c.fStart + c.fLen);
+         }
+      }
+      std::swap(fPrev, fCur);
+      prev  = name;
+      lprev = len;
+      name += len;
+   }
+
+   PutVarint(out, lens.size());
+   PutVarint(out, fStreams.size());
+   for (auto &s : fStreams)
+      PutVarint(out, s.size());
+   for (auto &s : fStreams)
+      out.insert(out.end(), s.begin(), s.end());
+}
+
+inline bool RAMNameCodec::Decode(const UChar_t *in, Int_t nin, std::vector<char> &names, std::vector<Int_t> &offsets)
+{
+   // Decode a block written by Encode(). The name of record i starts at
+   // names[offsets[i]] and is terminated by a '\0', offsets[i+1] follows.
+   // Returns false for a corrupt block.
+
+   const UChar_t *end = in + nin;
+   ULong64_t nrec, nstreams;
+   if (!GetVarint(in, end, nrec) || nrec > (ULong64_t) nin || !GetVarint(in, end, nstreams) || nstreams == 0 ||
+       nstreams > (ULong64_t) nin || (nstreams - 1) % kNStreams)
+      return false;
+   std::vector<ULong64_t> sizes(nstreams);
+   for (auto &size : sizes)
+      if (!GetVarint(in, end, size))
+         return false;
+   std::vector<const UChar_t *> pos(nstreams), last(nstreams);
+   for (size_t i = 0; i < nstreams; i++) {
+      if (sizes[i] > (ULong64_t) (end - in))
+         return false;
+      pos[i]  = in;
+      in     += sizes[i];
+      last[i] = in;
+   }
+
+   // append len characters of names from offset from
+   auto copy = [&names](Int_t from, Int_t len) {
+      size_t at = names.size();
+      names.resize(at + len);
+      memmove(names.data() + at, names.data() + from, len);
+   };
+
+   names.clear();
+   offsets.resize(nrec + 1);
+   offsets[0] = 0;
+   fPrev.clear();
+   Int_t prev = 0;
+   for (ULong64_t r = 0; r < nrec; r++) {
+      Int_t start = names.size();
+      ULong64_t code, v;
+      if (!GetVarint(pos[0], last[0], code) || (code && code - 1 > (nstreams - 1) / kNStreams))
+         return false;
+      if (code == 0) {
+         // the previous name, with the same tokens
+         copy(prev, r ? start - prev - 1 : 0);
+         for (auto &t : fPrev)
+            t.fStart += start - prev;
+      } else {
+         fCur.resize(code - 1);
+         for (size_t t = 0; t < fCur.size(); t++) {
+            const UChar_t **s = &pos[1 + kNStreams * t], *const *e = &last[1 + kNStreams * t];
+            const Token *pt = t < fPrev.size() ? &fPrev[t] : nullptr;
+            Token &c = fCur[t];
+            if (s[kOps] == e[kOps])
+               return false;
+            UChar_t op = *s[kOps]++;
+            if (op == kMatch && pt) {
+               c = *pt;
+               c.fStart = names.size();
+               copy(pt->fStart, pt->fLen);
+               continue;
+            }
+            c.fStart = names.size();
+            if (op == kString && GetVarint(s[kStrings], e[kStrings], v) &&
+                v <= (ULong64_t) (e[kStrings] - s[kStrings])) {
+               c.fNum = false;
+               c.fLen = v;
+               names.insert(names.end(), s[kStrings], s[kStrings] + v);
+               s[kStrings] += v;
+               continue;
+            }
+            if (op == kDelta && pt && pt->fNum && s[kDeltas] < e[kDeltas])
+               c.fValue = pt->fValue + *s[kDeltas]++;
+            else if (op == kNumber && GetVarint(s[kNumbers], e[kNumbers], v))
+               c.fValue = v;
+            else
+               return false;
+            char digits[24];
+            Int_t n = 0;
+            for (ULong64_t x = c.fValue; n == 0 || x; x /= 10)
+               digits[n++] = '0' + x % 10;
+            std::reverse(digits, digits + n);
+            c.fNum = true;
+            c.fLen = n;
+            names.insert(names.end(), digits, digits + n);
+         }
+         std::swap(fPrev, fCur);
+      }
+      names.push_back('\0');
+      prev = start;
+      offsets[r+1] = names.size();
+   }
+   return true;
+}
+
+#endif
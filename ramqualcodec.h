@@ -0,0 +1,245 @@
+//
+// RAMQualCodec is a lossless entropy coder for the QUAL column, selected
+// with the RAMRecord::kQualCodec quality policy. The qualities of a block
+// of records are coded at once with an adaptive order-2 context model,
+// the context being the previous two qualities of the read, and a range
+// coder, in the spirit of the fqzcomp quality codec of CRAM 3.1. Used by
+// RAMColumns for version 2 files.
+//
+
+#ifndef RAMQualCodec_h
+#define RAMQualCodec_h
+
+#include <Rtypes.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+
+class RAMQualCodec {
+private:
+   static const UInt_t kTop      = 1 << 24;   // range coder normalization bounds
+   static const UInt_t kBot      = 1 << 16;
+   static const UInt_t kStep     = 16;        // frequency increment per coded symbol
+   static const UInt_t kMaxTotal = kBot - kStep;
+   static const Int_t  kContexts = 64 * 16;   // previous quality x quantized quality before
+
+   // Adaptive frequencies of the symbols in one context, kept roughly
+   // sorted by decreasing frequency so the linear searches are short.
+   struct Model {
+      UShort_t fFreq[256];
+      UChar_t  fSym[256];
+      UInt_t   fTotal;
+      Int_t    fN;   // alphabet size, 0 when not yet used in this block
+
+      void Init(Int_t n);
+      void Update(Int_t i);
+   };
+
+   std::vector<Model> fModels;    // one per context
+   std::vector<Int_t> fUsed;      // contexts used in the current block
+   Int_t              fNSym;      // alphabet size of the current block
+
+   Model &GetModel(Int_t ctx);
+   static Int_t Context(Int_t q1, Int_t q2) { return (std::min(q1, 63) << 4) | (std::min(q2, 63) >> 2); }
+   static void  PutVarint(std::vector<UChar_t> &out, UInt_t v);
+   static bool  GetVarint(const UChar_t *&in, const UChar_t *end, UInt_t &v);
+
+public:
+   RAMQualCodec() : fModels(kContexts), fNSym(0) { }
+
+   void Encode(const UChar_t *qual, const std::vector<Int_t> &lens, std::vector<UChar_t> &out);
+   bool Decode(const UChar_t *in, Int_t nin, std::vector<UChar_t> &qual, std::vector<Int_t> &offsets);
+};
+
+
+inline void RAMQualCodec::Model::Init(Int_t n)
+{
+   fN = n;
+   fTotal = n;
+   for (Int_t i = 0; i < n; i++) {
+      fFreq[i] = 1;
+      fSym[i]  = i;
+   }
+}
+
+inline void RAMQualCodec::Model::Update(Int_t i)
+{
+   // Count symbol i, move it up when it became more frequent than its
+   // predecessor. The frequencies are halved first when the total would
+   // get too large, so the total and every frequency stay below kBot.
+
+   if (fTotal + kStep > kMaxTotal) {
+      fTotal = 0;
+      for (Int_t j = 0; j < fN; j++) {
+         fFreq[j] -= fFreq[j] >> 1;
+         fTotal   += fFreq[j];
+      }
+   }
+   fFreq[i] += kStep;
+   fTotal   += kStep;
+   if (i > 0 && fFreq[i] > fFreq[i-1]) {
+      std::swap(fFreq[i], fFreq[i-1]);
+      std::swap(fSym[i], fSym[i-1]);
+   }
+}
+
+inline RAMQualCodec::Model &RAMQualCodec::GetModel(Int_t ctx)
+{
+   // The model of ctx, initialized on first use in a block.
+
+   Model &m = fModels[ctx];
+   if (m.fN == 0) {
+      m.Init(fNSym);
+      fUsed.push_back(ctx);
+   }
+   return m;
+}
+
+inline void RAMQualCodec::PutVarint(std::vector<UChar_t> &out, UInt_t v)
+{
+   while (v >= 0x80) {
+      out.push_back(v | 0x80);
+      v >>= 7;
+   }
+   out.push_back(v);
+}
+
+inline bool RAMQualCodec::GetVarint(const UChar_t *&in, const UChar_t *end, UInt_t &v)
+{
+   v = 0;
+   for (Int_t shift = 0; in < end && shift < 35; shift += 7) {
+      UChar_t c = *in++;
+      v |= (UInt_t) (c & 0x7f) << shift;
+      if (!(c & 0x80))
+         return true;
+   }
+   return false;
+}
+
+inline void RAMQualCodec::Encode(const UChar_t *qual, const std::vector<Int_t> &lens, std::vector<UChar_t> &out)
+{
+   // Encode the qualities of a block of records, qual holds the qualities of
+   // record i, lens[i] bytes, one after the other. The block is appended to
+   // out: the number of records, their lengths, the smallest and largest
+   // quality and the range coded qualities.
+
+   size_t n = 0;
+   for (auto l : lens)
+      n += l;
+   UChar_t qmin = 255, qmax = 0;
+   for (size_t i = 0; i < n; i++) {
+      qmin = std::min(qmin, qual[i]);
+      qmax = std::max(qmax, qual[i]);
+   }
+   if (n == 0)
+      qmin = qmax = 0;
+
+   PutVarint(out, lens.size());
+   for (auto l : lens)
+      PutVarint(out, l);
+   out.push_back(qmin);
+   out.push_back(qmax);
+   if (n == 0)
+      return;
+
+   fNSym = qmax - qmin + 1;
+   UInt_t low = 0, range = 0xffffffff;
+   const UChar_t *q = qual;
+   for (auto l : lens) {
+      Int_t q1 = 0, q2 = 0;
+      for (Int_t j = 0; j < l; j++) {
+         Int_t s = q[j] - qmin;
+         Model &m = GetModel(Context(q1, q2));
+         UInt_t cum = 0;
+         Int_t  i = 0;
+         while (m.fSym[i] != s)
+            cum += m.fFreq[i++];
+         range /= m.fTotal;
+         low   += cum * range;
+         range *= m.fFreq[i];
+         while ((low ^ (low + range)) < kTop || (range < kBot && ((range = -low & (kBot - 1)), true))) {
+            out.push_back(low >> 24);
+            low   <<= 8;
+            range <<= 8;
+         }
+         m.Update(i);
+         q2 = q1;
+         q1 = s;
+      }
+      q += l;
+   }
+   for (Int_t i = 0; i < 4; i++) {
+      out.push_back(low >> 24);
+      low <<= 8;
+   }
+
+   for (auto ctx : fUsed)
+      fModels[ctx].fN = 0;
+   fUsed.clear();
+}
+
+inline bool RAMQualCodec::Decode(const UChar_t *in, Int_t nin, std::vector<UChar_t> &qual, std::vector<Int_t> &offsets)
+{
+   // Decode a block written by Encode(). The qualities of record i are
+   // qual[offsets[i]] up to qual[offsets[i+1]]. Returns false for a corrupt
+   // block.
+
+   const UChar_t *end = in + nin;
+   UInt_t nrec, l;
+   if (!GetVarint(in, end, nrec) || nrec > (UInt_t) nin)
+      return false;
+   offsets.resize(nrec + 1);
+   offsets[0] = 0;
+   for (UInt_t i = 0; i < nrec; i++) {
+      if (!GetVarint(in, end, l) || l > 0x7fffffff - (UInt_t) offsets[i])
+         return false;
+      offsets[i+1] = offsets[i] + l;
+   }
+   if (end - in < 2)
+      return false;
+   UChar_t qmin = *in++, qmax = *in++;
+   qual.resize(offsets[nrec]);
+   if (offsets[nrec] == 0)
+      return true;
+   if (qmax < qmin)
+      return false;
+
+   fNSym = qmax - qmin + 1;
+   auto next = [&in, end]() -> UInt_t { return in < end ? *in++ : 0; };
+   UInt_t low = 0, range = 0xffffffff, code = 0;
+   for (Int_t i = 0; i < 4; i++)
+      code = (code << 8) | next();
+   UChar_t *q = qual.data();
+   for (UInt_t r = 0; r < nrec; r++) {
+      Int_t q1 = 0, q2 = 0;
+      for (Int_t j = offsets[r]; j < offsets[r+1]; j++) {
+         Model &m = GetModel(Context(q1, q2));
+         range /= m.fTotal;
+         UInt_t target = std::min((code - low) / range, m.fTotal - 1);
+         UInt_t cum = 0;
+         Int_t  i = 0;
+         while (cum + m.fFreq[i] <= target)
+            cum += m.fFreq[i++];
+         low   += cum * range;
+         range *= m.fFreq[i];
+         while ((low ^ (low + range)) < kTop || (range < kBot && ((range = -low & (kBot - 1)), true))) {
+            code    = (code << 8) | next();
+            low   <<= 8;
+            range <<= 8;
+         }
+         Int_t s = m.fSym[i];
+         m.Update(i);
+         q[j] = s + qmin;
+         q2 = q1;
+         q1 = s;
+      }
+   }
+
+   for (auto ctx : fUsed)
+      fModels[ctx].fN = 0;
+   fUsed.clear();
+   return true;
+}
+
+#endif
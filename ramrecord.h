@@ -11,58 +11,226 @@
 #include <TObject.h>
 #include <TString.h>
 #include <TError.h>
+#include <ROOT/RStringView.hxx>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <vector>
+#include <map>
 
+#include "ramkernels.h"
 
+class TTree;
+class TFile;
+class TDirectory;
+
+// Reference sequence dictionary, mapping names to refids, the index in
+// the dictionary. One dictionary is used for RNAME and RNEXT. Names are
+// looked up via a hash table, which is not stored but rebuilt on demand.
 class RAMRefs {
 private:
    typedef std::vector<std::string> Refs_t;
-   Refs_t      fRefVec;
-   int         fLastId;
-   int         fMaxId;
-   std::string fLastName;
-   
+   Refs_t              fRefVec;    // reference names, indexed by refid
+   std::vector<Int_t>  fRefLen;    // reference lengths (@SQ LN), 0 if not known
+   int                 fLastId;    //! refid of the last lookup
+   std::vector<Int_t>  fHash;      //! open addressing table of refids, -1 if empty slot
+
+   static UInt_t Hash(const char *rname, Int_t len);
+   bool          Equal(int rid, const char *rname, Int_t len) const {
+      return (Int_t) fRefVec[rid].size() == len && !memcmp(fRefVec[rid].data(), rname, len);
+   }
+
 public:
-   RAMRefs();
+   RAMRefs() : fLastId(-1) { }
    ~RAMRefs() { }
 
-   int         GetRefId(const char *rname);
-   const char *GetRefName(int rid);
+   int         GetRefId(const char *rname) { return GetRefId(rname, strlen(rname)); }
+   int         GetRefId(const char *rname, Int_t len);
+   int         GetRefId(std::string_view rname) { return GetRefId(rname.data(), rname.size()); }
+   int         FindRefId(const char *rname) const { return FindRefId(rname, strlen(rname)); }
+   int         FindRefId(const char *rname, Int_t len) const;
+   int         FindRefId(std::string_view rname) const { return FindRefId(rname.data(), rname.size()); }
+   int         AddSQ(std::string_view line);
+   const char *GetRefName(int rid) const;
+   Int_t       GetRefLength(int rid) const { return rid >= 0 && rid < (int) fRefLen.size() ? fRefLen[rid] : 0; }
+   void        SetRefLength(int rid, Int_t len);
+   void        Rehash();
 
    void    Print() const;
    ULong_t Size() const { return fRefVec.size(); }
    
-   ClassDefNV(RAMRefs,1)
+   ClassDefNV(RAMRefs,2)
 };
 
 
+// Sampled index of a single reference sequence, see RAMIndex. The sorted
+// positions and their rows are stored as two flat arrays, for the search
+// the positions are laid out in Eytzinger (breadth first) order.
+class RAMIndexRef {
+friend class RAMIndex;
+private:
+   std::vector<Int_t>    fPos;       // sorted positions
+   std::vector<Long64_t> fRow;       // TTree entry number of each position
+   std::vector<Int_t>    fEytzPos;   //! fPos in Eytzinger order, 1-based
+   std::vector<Int_t>    fEytzIdx;   //! index in fPos of each Eytzinger slot
+
+   void     FillEytzinger(size_t &i, size_t k);
+
+public:
+   RAMIndexRef() { }
+   ~RAMIndexRef() { }
+
+   void     Build();
+   Long64_t Find(Int_t pos) const;
+   ULong_t  Size() const { return fPos.size(); }
+
+   ClassDefNV(RAMIndexRef,1)
+};
+
 class RAMIndex {
 private:
    typedef std::pair<int,int> Key_t;          // refid (of rname) and pos
    typedef std::map<Key_t,Long64_t> Index_t;  // map of Key_t and TTree entry number
    
-   Index_t fIndex;
+   Index_t                    fIndex;      // version 1 index, only filled for old files
+   std::vector<Long64_t>      fStartRow;   // row to start from for each refid
+   Long64_t                   fSize;       // number of items
+   std::vector<RAMIndexRef*>  fRefs;       //! per refid partitions, loaded on demand
+   TDirectory                *fDir;        //! directory holding the partitions
+
+   RAMIndexRef *GetRef(int refid);
 
 public:
-   RAMIndex() { }
-   ~RAMIndex() { }
+   RAMIndex() : fSize(0), fDir(nullptr) { }
+   ~RAMIndex();
    
    void     AddItem(int refid, int pos, Long64_t row);
    Long64_t GetRow(int refid, int pos);
    
-   void    Print() const;
-   ULong_t Size() const { return fIndex.size(); }
+   void     Write(TDirectory *dir, const char *name = "Index");
+   static RAMIndex *Read(TDirectory *dir, const char *name = "Index");
+
+   void    Print();
+   ULong_t Size() const { return fIndex.empty() ? fSize : fIndex.size(); }
    
-   ClassDefNV(RAMIndex,1)
+   ClassDefNV(RAMIndex,2)
+};
+
+
+// Binned overlap index of a single reference sequence, see RAMBinIndex.
+class RAMBinIndexRef {
+friend class RAMBinIndex;
+private:
+   typedef std::vector<Long64_t>       Chunks_t;  // first and last+1 entry of each chunk
+   typedef std::map<UInt_t,Chunks_t>   Bins_t;    // chunks of each bin
+
+   Bins_t                fBins;     // chunks of each bin
+   std::vector<Long64_t> fLinear;   // smallest entry overlapping each 16kbp window
+
+public:
+   RAMBinIndexRef() { }
+   ~RAMBinIndexRef() { }
+
+   ClassDefNV(RAMBinIndexRef,1)
+};
+
+class RAMBinIndex {
+public:
+   typedef std::pair<Long64_t,Long64_t> Chunk_t;   // entries [first, last)
+
+   static const Int_t kMinShift = 14;         // 16kbp windows of the linear index
+   static const Int_t kMaxPos   = 1 << 29;    // positions beyond are put in the last window
+
+private:
+   Int_t                         fNRefs;     // number of refids
+   Bool_t                        fSorted;    // records were added in (refid,pos) order
+   std::vector<RAMBinIndexRef*>  fRefs;      //! per refid partitions, loaded on demand
+   TDirectory                   *fDir;       //! directory holding the partitions
+   Int_t                         fLastRefId; //! refid of last added record
+   Int_t                         fLastPos;   //! pos of last added record
+
+   RAMBinIndexRef *GetRef(int refid);
+
+public:
+   RAMBinIndex() : fNRefs(0), fSorted(kTRUE), fDir(nullptr), fLastRefId(-1), fLastPos(0) { }
+   ~RAMBinIndex();
+
+   static UInt_t Reg2Bin(Int_t beg, Int_t end);
+   static void   Reg2Bins(Int_t beg, Int_t end, std::vector<UInt_t> &bins);
+
+   void     AddItem(int refid, Int_t beg, Int_t end, Long64_t row);
+   void     Finalize(TTree *tree);
+   void     GetChunks(int refid, Int_t beg, Int_t end, std::vector<Chunk_t> &chunks);
+   Bool_t   IsSorted() const { return fSorted; }
+
+   void     Write(TDirectory *dir, const char *name = "BinIndex");
+   static RAMBinIndex *Read(TDirectory *dir, const char *name = "BinIndex");
+
+   void     Print();
+   ULong_t  Size() const { return fNRefs; }
+
+   ClassDefNV(RAMBinIndex,2)
+};
+
+// Statistics of the records of each tree cluster (zone): the range of the
+// refid and pos, the largest alignment end, the OR and AND of the flags
+// and the range of MAPQ. A filter scan skips the zones that cannot contain
+// a matching record, see MayMatch() and GetRanges(). Filled per block of
+// kBlockSize entries, which Finalize() merges into the clusters of the
+// tree, a block on a cluster boundary is counted in both clusters.
+class RAMZoneMap {
+public:
+   typedef std::pair<Long64_t,Long64_t> Range_t;   // entries [first, last)
+
+   static const Int_t kBlockSize = 1024;   // entries per zone while filling
+   static const Int_t kAnyRefId  = -2;     // no refid selection
+
+private:
+   std::vector<Long64_t> fStart;      // first entry of each zone, followed by the number of entries
+   std::vector<Int_t>    fMinRefId;   // smallest refid, -1 for unmapped records
+   std::vector<Int_t>    fMaxRefId;   // largest refid
+   std::vector<Int_t>    fMinPos;     // smallest pos
+   std::vector<Int_t>    fMaxPos;     // largest pos
+   std::vector<Int_t>    fMaxEnd;     // largest alignment end
+   std::vector<UShort_t> fFlagOr;     // bits set in the flag of any record
+   std::vector<UShort_t> fFlagAnd;    // bits set in the flag of all records
+   std::vector<UChar_t>  fMinMapq;    // smallest MAPQ
+   std::vector<UChar_t>  fMaxMapq;    // largest MAPQ
+   Long64_t              fEntries;    // number of entries added
+
+   void     Merge(Int_t zone, const RAMZoneMap &from, Int_t fromzone);
+
+public:
+   RAMZoneMap() : fEntries(0) { }
+
+   void     AddItem(Int_t refid, Int_t pos, Int_t end, UShort_t flag, UChar_t mapq);
+   void     Finalize(TTree *tree);
+   Int_t    GetNZones() const { return fMinRefId.size(); }
+   Long64_t GetZoneStart(Int_t zone) const { return fStart[zone]; }
+   Long64_t GetZoneEnd(Int_t zone) const { return fStart[zone+1]; }
+   Bool_t   MayMatch(Int_t zone, UShort_t required, UShort_t filtered, UChar_t minmapq,
+                     Int_t refid = kAnyRefId, Int_t beg = 0, Int_t end = RAMBinIndex::kMaxPos) const;
+   Long64_t GetRanges(UShort_t required, UShort_t filtered, UChar_t minmapq, Int_t refid, Int_t beg, Int_t end,
+                      std::vector<Range_t> &ranges) const;
+
+   void     Write(TDirectory *dir, const char *name = "ZoneMap");
+   static RAMZoneMap *Read(TDirectory *dir, const char *name = "ZoneMap");
+
+   void     Print();
+
+   ClassDefNV(RAMZoneMap,1)
 };
 
 
 class RAMRecord : public TObject {
+friend class RAMColumns;
 public:
    enum EQualCompressionBits {
       kPhred33          = BIT(14),   // Default Phred+33 quality score
       kIlluminaBinning  = BIT(15),   // Illumina 8 bin compression
-      kDrop             = BIT(16)    // Drop quality score
+      kDrop             = BIT(16),   // Drop quality score
+      kQualCodec        = BIT(17)    // Lossless entropy coded quality score, see RAMQualCodec
    };
 
 private:
@@ -82,25 +250,27 @@ private:
    UChar_t        *v_qual;           //[v_lseq] ASCII of Phred-scaled base QUALity+33
    Int_t           v_nopt;           // Number of optional fields
    TString        *v_opt;            //[v_nopt] Optional fields
-   
+   Int_t           fSeqSize;         //! allocated size of v_seq
+   Int_t           fQualSize;        //! allocated size of v_qual
+   Int_t           fCigarSize;       //! allocated size of v_cigar
+   Int_t           fOptSize;         //! allocated size of v_opt
+
    static RAMRefs  *fgRnameRefs;
-   static RAMRefs  *fgRnextRefs;
+   static RAMRefs  *fgRnextRefs;     // separate RNEXT refs of files written before they were unified
    static RAMIndex *fgIndex;
+   static RAMBinIndex *fgBinIndex;
 
-   static void      WriteRefs(const RAMRefs *refs, const char *name);
    static void      ReadRefs(RAMRefs *&refs, const char *name);
-   static void      WriteRnameRefs() { WriteRefs(fgRnameRefs, "RnameRefs"); }
-   static void      WriteRnextRefs() { WriteRefs(fgRnextRefs, "RnextRefs"); }
    static void      ReadRnameRefs()  { ReadRefs(fgRnameRefs, "RnameRefs"); }
    static void      ReadRnextRefs()  { ReadRefs(fgRnextRefs, "RnextRefs"); }
+   static void      InitStatics();
 
 public:
    RAMRecord() : v_flag(0), v_refid(-1), v_pos(0), v_mapq(0), v_ncigar_op(0), v_cigar(nullptr),
                  v_refnext(-1), v_pnext(0), v_tlen(0), v_lseq(0), v_nopt(0),
-                 v_lseq2(0), v_seq(nullptr), v_qual(nullptr), v_opt(nullptr) {
-                    if (!fgRnameRefs) fgRnameRefs = new RAMRefs;
-                    if (!fgRnextRefs) fgRnextRefs = new RAMRefs;
-                    if (!fgIndex)     fgIndex     = new RAMIndex;
+                 v_lseq2(0), v_seq(nullptr), v_qual(nullptr), v_opt(nullptr), fSeqSize(0), fQualSize(0), fCigarSize(0),
+                 fOptSize(0) {
+                    if (!fgRnameRefs || !fgIndex || !fgBinIndex) InitStatics();
                  }
    RAMRecord(const RAMRecord &rec);
    RAMRecord &operator=(const RAMRecord &rhs);
@@ -110,38 +280,63 @@ public:
                           delete [] v_opt;   v_opt   = nullptr; }
 
    void SetQNAME(const char *qname) { v_qname = qname; }
+   void SetQNAME(const char *qname, Int_t len) { v_qname.Resize(0); v_qname.Append(qname, len); }
    void SetFLAG(UShort_t f) { v_flag = f; }
-   void SetREFID(const char *rname);
+   void SetREFID(const char *rname, RAMRefs *refs);
+   void SetREFID(const char *rname, Int_t len, RAMRefs *refs);
+   void SetREFID(Int_t refid) { v_refid = refid; }
    void SetPOS(Int_t pos) { v_pos = pos - 1; }
    void SetMAPQ(UChar_t mapq) { v_mapq = mapq; }
-   void SetCIGAR(const char *cigar);
-   void SetREFNEXT(const char *rnext);
+   void SetCIGAR(const char *cigar) { SetCIGAR(cigar, strlen(cigar)); }
+   void SetCIGAR(const char *cigar, Int_t len);
+   void SetCIGAR(const UInt_t *cigar, Int_t nops);
+   void SetREFNEXT(const char *rnext, RAMRefs *refs);
+   void SetREFNEXT(const char *rnext, Int_t len, RAMRefs *refs);
+   void SetREFNEXT(Int_t refnext) { v_refnext = refnext; }
    void SetPNEXT(Int_t pnext) { v_pnext = pnext - 1; }
    void SetTLEN(Int_t tlen) { v_tlen = tlen; }
-   void SetSEQ(const char *seq);
-   void SetQUAL(const char *qual);
+   void SetSEQ(const char *seq) { SetSEQ(seq, strlen(seq)); }
+   void SetSEQ(const char *seq, Int_t len);
+   void SetPackedSEQ(const UChar_t *seq, Int_t lseq);
+   void SetQUAL(const char *qual) { SetQUAL(qual, strlen(qual)); }
+   void SetQUAL(const char *qual, Int_t len);
+   void SetPhredQUAL(const UChar_t *qual);
    void ResetNOPT() { v_nopt = 0; }
-   void SetOPT(const char *opt);
+   void SetOPT(const char *opt) { SetOPT(opt, strlen(opt)); }
+   void SetOPT(const char *opt, Int_t len);
+   void Swap(RAMRecord &rec);
 
    const char *GetQNAME() const { return v_qname; }
    UInt_t      GetFLAG() const { return v_flag; }
-   const char *GetRNAME() const;
+   const char *GetRNAME(const RAMRefs *refs) const;
    Int_t       GetREFID() const { return v_refid; }
    Int_t       GetPOS() const { return v_pos; }
+   Int_t       GetEND() const;
+   static Int_t GetSpan(const UInt_t *cigar, Int_t ncigar);
    UInt_t      GetMAPQ() const { return v_mapq; }
-   Int_t       GetNCIGAROP() { return v_ncigar_op; }
-   Int_t       GetCIGAROPLEN(Int_t idx);
-   Int_t       GetCIGAROP(Int_t idx);
+   Int_t       GetNCIGAROP() const { return v_ncigar_op; }
+   Int_t       GetCIGAROPLEN(Int_t idx) const;
+   Int_t       GetCIGAROP(Int_t idx) const;
    const char *GetCIGAR() const;
-   const char *GetRNEXT() const;
+   Int_t       GetCIGAR(char *cigar, Int_t size) const;
+   const char *GetRNEXT(const RAMRefs *refs, const RAMRefs *rnextrefs = nullptr) const;
    Int_t       GetREFNEXT() const { return v_refnext; }
    Int_t       GetPNEXT() const { return v_pnext; }
    Int_t       GetTLEN() const { return v_tlen; }
    Int_t       GetSEQLEN() const { return v_lseq; }
    const char *GetSEQ() const;
+   Int_t       GetSEQ(char *seq, Int_t size) const;
    const char *GetQUAL() const;
+   Int_t       GetQUAL(char *qual, Int_t size) const;
    Int_t       GetNOPT() const { return v_nopt; }
    const char *GetOPT(Int_t idx) const;
+   const char *GetTag(const char *tag, char *type = nullptr) const;
+   bool        GetTag(const char *tag, Long64_t &value) const;
+
+   // Encoded fields, for formatters and bulk decoders
+   const UInt_t  *GetRawCIGAR() const { return v_cigar; }
+   const UChar_t *GetRawSEQ() const { return v_seq; }
+   const UChar_t *GetRawQUAL() const { return v_qual; }
 
    void        Print(Option_t *option="") const;
    
@@ -149,13 +344,14 @@ public:
 
    static RAMRefs  *GetRnameRefs() { return fgRnameRefs; }
    static RAMRefs  *GetRnextRefs() { return fgRnextRefs; }
-   static void      WriteAllRefs() { WriteRnameRefs(); WriteRnextRefs(); }
    static void      ReadAllRefs()  { ReadRnameRefs(); ReadRnextRefs(); }
 
    static RAMIndex *GetIndex() { return fgIndex; }
-   static void      WriteIndex();
    static void      ReadIndex();
 
+   static RAMBinIndex *GetBinIndex() { return fgBinIndex; }
+   static void         ReadBinIndex();
+
    ClassDef(RAMRecord,1)
 };
 
@@ -208,8 +404,10 @@ inline RAMRecord::RAMRecord(const RAMRecord &rec) : TObject(rec)
    v_cigar     = rec.v_cigar;
    v_ncigar_op = rec.v_ncigar_op;
    v_cigar     = nullptr;
+   fCigarSize  = 0;
    if (rec.v_cigar != nullptr) {
       v_cigar = new UInt_t[v_ncigar_op];
+      fCigarSize = v_ncigar_op;
       memcpy(v_cigar, rec.v_cigar, v_ncigar_op*sizeof(UInt_t));
    }
    v_refnext   = rec.v_refnext;
@@ -218,19 +416,25 @@ inline RAMRecord::RAMRecord(const RAMRecord &rec) : TObject(rec)
    v_lseq      = rec.v_lseq;
    v_lseq2     = rec.v_lseq2;
    v_seq       = nullptr;
+   fSeqSize    = 0;
    if (rec.v_seq != nullptr) {
       v_seq = new UChar_t[v_lseq2];
+      fSeqSize = v_lseq2;
       memcpy(v_seq, rec.v_seq, v_lseq2);
    }
    v_qual      = nullptr;
+   fQualSize   = 0;
    if (rec.v_qual != nullptr) {
       v_qual = new UChar_t[v_lseq];
+      fQualSize = v_lseq;
       memcpy(v_qual, rec.v_qual, v_lseq);
    }
    v_nopt      = rec.v_nopt;
    v_opt       = nullptr;
+   fOptSize    = 0;
    if (rec.v_opt != nullptr) {
       v_opt = new TString[v_nopt];
+      fOptSize = v_nopt;
       for (int i = 0; i < v_nopt; i++)
          v_opt[i] = rec.v_opt[i];
    }
@@ -251,9 +455,11 @@ inline RAMRecord &RAMRecord::operator=(const RAMRecord &rhs)
       if (v_cigar != nullptr) {
          delete [] v_cigar;
          v_cigar = nullptr;
+         fCigarSize = 0;
       }
       if (rhs.v_cigar != nullptr) {
          v_cigar = new UInt_t[v_ncigar_op];
+         fCigarSize = v_ncigar_op;
          memcpy(v_cigar, rhs.v_cigar, v_ncigar_op*sizeof(UInt_t));
       }
       v_refnext   = rhs.v_refnext;
@@ -264,26 +470,32 @@ inline RAMRecord &RAMRecord::operator=(const RAMRecord &rhs)
       if (v_seq != nullptr) {
          delete [] v_seq;
          v_seq = nullptr;
+         fSeqSize = 0;
       }
       if (rhs.v_seq != nullptr) {
          v_seq = new UChar_t[v_lseq2];
+         fSeqSize = v_lseq2;
          memcpy(v_seq, rhs.v_seq, v_lseq2);
       }
       if (v_qual != nullptr) {
          delete [] v_qual;
          v_qual = nullptr;
+         fQualSize = 0;
       }
       if (rhs.v_qual != nullptr) {
          v_qual = new UChar_t[v_lseq];
+         fQualSize = v_lseq;
          memcpy(v_qual, rhs.v_qual, v_lseq);
       }
       v_nopt     = rhs.v_nopt;
       if (v_opt != nullptr) {
          delete [] v_opt;
          v_opt = nullptr;
+         fOptSize = 0;
       }
       if (rhs.v_opt != nullptr) {
          v_opt = new TString[v_nopt];
+         fOptSize = v_nopt;
          for (int i = 0; i < v_nopt; i++)
             v_opt[i] = rhs.v_opt[i];
       }
@@ -291,222 +503,345 @@ inline RAMRecord &RAMRecord::operator=(const RAMRecord &rhs)
    return *this;
 }
 
-inline void RAMRecord::SetREFID(const char *rname)
+inline void RAMRecord::Swap(RAMRecord &rec)
 {
-   v_refid = fgRnameRefs->GetRefId(rname);
+   // Exchange the contents of this record with rec, without copying or
+   // reallocating the variable length arrays. Used to hand records parsed
+   // in another thread to the record connected to the tree branch.
+
+   const UInt_t kQualityBits = kPhred33 | kIlluminaBinning | kDrop | kQualCodec;
+   UInt_t bits = TestBits(kQualityBits);
+   SetBit(kQualityBits, kFALSE);
+   SetBit(rec.TestBits(kQualityBits));
+   rec.SetBit(kQualityBits, kFALSE);
+   rec.SetBit(bits);
+   std::swap(v_qname,     rec.v_qname);
+   std::swap(v_flag,      rec.v_flag);
+   std::swap(v_refid,     rec.v_refid);
+   std::swap(v_pos,       rec.v_pos);
+   std::swap(v_mapq,      rec.v_mapq);
+   std::swap(v_ncigar_op, rec.v_ncigar_op);
+   std::swap(v_cigar,     rec.v_cigar);
+   std::swap(v_refnext,   rec.v_refnext);
+   std::swap(v_pnext,     rec.v_pnext);
+   std::swap(v_tlen,      rec.v_tlen);
+   std::swap(v_lseq,      rec.v_lseq);
+   std::swap(v_lseq2,     rec.v_lseq2);
+   std::swap(v_seq,       rec.v_seq);
+   std::swap(v_qual,      rec.v_qual);
+   std::swap(v_nopt,      rec.v_nopt);
+   std::swap(v_opt,       rec.v_opt);
+   std::swap(fSeqSize,    rec.fSeqSize);
+   std::swap(fQualSize,   rec.fQualSize);
+   std::swap(fCigarSize,  rec.fCigarSize);
+   std::swap(fOptSize,    rec.fOptSize);
 }
 
-inline void RAMRecord::SetREFNEXT(const char *rnext)
+inline void RAMRecord::SetREFID(const char *rname, RAMRefs *refs)
 {
-   v_refnext = fgRnextRefs->GetRefId(rnext);
+   // Set the refid of rname in refs, e.g. those of RAMWriter::GetRnameRefs(),
+   // rname is entered when new.
+
+   v_refid = refs->GetRefId(rname);
 }
 
-inline const char *RAMRecord::GetRNAME() const
+inline void RAMRecord::SetREFNEXT(const char *rnext, RAMRefs *refs)
 {
-   return fgRnameRefs->GetRefName(v_refid);
+   SetREFNEXT(rnext, strlen(rnext), refs);
 }
 
-inline const char *RAMRecord::GetRNEXT() const
+inline void RAMRecord::SetREFID(const char *rname, Int_t len, RAMRefs *refs)
 {
-   return fgRnextRefs->GetRefName(v_refnext);
+   v_refid = refs->GetRefId(rname, len);
 }
 
+inline void RAMRecord::SetREFNEXT(const char *rnext, Int_t len, RAMRefs *refs)
+{
+   // RNEXT shares the refs of RNAME, "=" is the refid of RNAME, so call
+   // SetREFID() first
+   if (len == 1 && rnext[0] == '=')
+      v_refnext = v_refid;
+   else
+      v_refnext = refs->GetRefId(rnext, len);
+}
+
+inline const char *RAMRecord::GetRNAME(const RAMRefs *refs) const
+{
+   return refs->GetRefName(v_refid);
+}
+
+inline const char *RAMRecord::GetRNEXT(const RAMRefs *refs, const RAMRefs *rnextrefs) const
+{
+   // older files have separate RNEXT refs, rnextrefs, in which "=" is a name
+   if (rnextrefs)
+      return rnextrefs->GetRefName(v_refnext);
+   if (v_refnext >= 0 && v_refnext == v_refid)
+      return "=";
+   return refs->GetRefName(v_refnext);
+}
 
-static const char *codetoseq = "=ACMGRSVTWYHKDBN";
 
-inline void RAMRecord::SetSEQ(const char *seq)
+inline void RAMRecord::SetSEQ(const char *seq, Int_t len)
 {
    // Use BAM like encoding for the segment SEQuence. This uses about half
    // the space compared to an ASCII string as the allowed character set is limited
    // (fits in 4 instead of 8 bits).
 
-   static UChar_t seqtocode[256];
-   static bool init = false;
-   if (!init) {
-      memset(seqtocode, 0, 256);
-      for (int i = 1; i < 16; i++) {
-         seqtocode[codetoseq[i]] = i;
-      }
-      init = true;
-   }
+   // "*", no sequence stored
+   if (len == 1 && seq[0] == '*')
+      len = 0;
 
-   static Int_t maxlseq2 = 0;
-   v_lseq = strlen(seq);
+   v_lseq = len;
    v_lseq2 = (v_lseq + 1)/2;
 
-   if (v_seq != nullptr && v_lseq2 > maxlseq2) {
+   if (v_seq != nullptr && v_lseq2 > fSeqSize) {
       delete [] v_seq;
       v_seq = nullptr;
    }
 
    if (v_seq == nullptr && v_lseq2) {
-      maxlseq2 = v_lseq2;
+      fSeqSize = v_lseq2;
       v_seq = new UChar_t[v_lseq2];
    }
 
-   int j = 0;
-   for (int i = 0; i + 1 < v_lseq; i += 2) {
-      v_seq[j] = (seqtocode[seq[i]] << 4) | seqtocode[seq[i+1]];
-      j++;
-   }
-   if (v_lseq % 2) {
-      v_seq[j] = seqtocode[seq[v_lseq-1]] << 4;
-   }
+   RAMKernels::PackSEQ(seq, v_lseq, v_seq);
 }
 
 
-inline const char *RAMRecord::GetSEQ() const
+inline void RAMRecord::SetPackedSEQ(const UChar_t *seq, Int_t lseq)
 {
-   // Decode segment SEQuence from BAM like encoded format. See SetSEQ().
+   // Set segment SEQuence already in the BAM 4-bit encoding, as found in
+   // BAM records.
 
-   static UShort_t codetoseqpair[256];
-   static bool init = false;
-   if (!init) {
-      for (int i = 0; i < 256; i++) {
-         codetoseqpair[i] = (codetoseq[i >> 4]) | (codetoseq[i & 0xf] << 8);
-      }
-      init = true;
+   v_lseq = lseq;
+   v_lseq2 = (v_lseq + 1)/2;
+
+   if (v_seq != nullptr && v_lseq2 > fSeqSize) {
+      delete [] v_seq;
+      v_seq = nullptr;
+   }
+
+   if (v_seq == nullptr && v_lseq2) {
+      fSeqSize = v_lseq2;
+      v_seq = new UChar_t[v_lseq2];
    }
 
-   static int maxlseq = 0;
-   static char *seq = nullptr;
+   memcpy(v_seq, seq, v_lseq2);
+}
 
-   // in case column v_seq is not read
-   if (!v_seq)
-      return "";
+inline Int_t RAMRecord::GetSEQ(char *seq, Int_t size) const
+{
+   // Decode segment SEQuence from BAM like encoded format into seq, a buffer
+   // of size characters. Returns the length of the SEQuence, when the buffer
+   // is too small only an empty string is stored and the call should be
+   // repeated with a buffer of at least the returned length + 1. Does not
+   // use any shared state, so it can be used from several threads.
 
-   if (seq != nullptr && v_lseq > maxlseq) {
-      delete [] seq;
-      seq = nullptr;
+   // in case column v_seq is not read
+   Int_t lseq = v_seq ? v_lseq : 0;
+   if (size <= lseq) {
+      if (size > 0)
+         seq[0] = '\0';
+      return lseq;
    }
 
-   if (seq == nullptr && v_lseq) {
-      maxlseq = v_lseq;
-      seq = new char[v_lseq+1];
-      seq[v_lseq] = '\0';
-   }
+   RAMKernels::UnpackSEQ(v_seq, lseq, seq);
+   seq[lseq] = '\0';
 
-   UShort_t *seqpairs = (UShort_t*) seq;
-   int pairs = v_lseq / 2;
-   for (int i = 0; i < pairs; i++) {
-      seqpairs[i] = codetoseqpair[v_seq[i]];
-   }
-   if (v_lseq % 2) {
-      seq[v_lseq-1] = codetoseq[v_seq[v_lseq / 2] >> 4];
-   }
+   return lseq;
+}
 
-   return seq;
+inline const char *RAMRecord::GetSEQ() const
+{
+   // Decode segment SEQuence into a per thread buffer, valid until the next
+   // call in the same thread. See GetSEQ(char*,Int_t).
+
+   thread_local std::vector<char> seq(256);
+   Int_t len = GetSEQ(seq.data(), seq.size());
+   if (len >= (Int_t) seq.size()) {
+      seq.resize(len + 1);
+      GetSEQ(seq.data(), seq.size());
+   }
+   return seq.data();
 }
 
-inline void RAMRecord::SetQUAL(const char *qual)
+inline void RAMRecord::SetQUAL(const char *qual, Int_t len)
 {
    // Set QUALity string. This is in Phred+33 scale, same as in BAM.
+   // The quality string has v_lseq entries, a shorter one (e.g. "*")
+   // is padded with 0's.
 
-   static Int_t maxlqual = 0;
-
-   if (v_qual != nullptr && v_lseq > maxlqual) {
+   if (v_qual != nullptr && v_lseq > fQualSize) {
       delete [] v_qual;
       v_qual = nullptr;
    }
 
    if (v_qual == nullptr && v_lseq) {
-      maxlqual = v_lseq;
+      fQualSize = v_lseq;
       v_qual = new UChar_t[v_lseq];
    }
 
+   if (len > v_lseq)
+      len = v_lseq;
+
    if (TestBit(RAMRecord::kPhred33)) {
-      memcpy(v_qual, qual, v_lseq);
+      memcpy(v_qual, qual, len);
    } else if (TestBit(RAMRecord::kIlluminaBinning)) {
-      for (int i = 0; i < v_lseq; i++)
-         v_qual[i] = IlluminaBinning(qual[i]);
+      RAMKernels::BinQUAL((const UChar_t *) qual, len, v_qual, 33);
    } else if (TestBit(RAMRecord::kDrop)) {
-      memset(v_qual, 0, v_lseq);
+      len = 0;
    } else
-      memcpy(v_qual, qual, v_lseq);
+      memcpy(v_qual, qual, len);
+
+   if (len < v_lseq)
+      memset(v_qual + len, 0, v_lseq - len);
 }
 
-inline const char *RAMRecord::GetQUAL() const
+inline void RAMRecord::SetPhredQUAL(const UChar_t *qual)
 {
-   // Decode QUALity. See also SetQUAL().
+   // Set QUALity from v_lseq raw Phred scores, as found in BAM records.
+   // A first score of 0xff means the quality is missing ("*" in SAM).
+   // Call after setting the SEQuence.
+
+   if (v_qual != nullptr && v_lseq > fQualSize) {
+      delete [] v_qual;
+      v_qual = nullptr;
+   }
 
-   static int maxlqual = 0;
-   static char *qual = nullptr;
+   if (v_qual == nullptr && v_lseq) {
+      fQualSize = v_lseq;
+      v_qual = new UChar_t[v_lseq];
+   }
 
-   // in case column v_qual is not read
-   if (!v_qual)
-      return "";
+   if (v_lseq == 0)
+      return;
 
-   if (qual != nullptr && v_lseq > maxlqual) {
-      delete [] qual;
-      qual = nullptr;
+   if (qual[0] == 0xff || TestBit(RAMRecord::kDrop)) {
+      memset(v_qual, 0, v_lseq);
+      if (!TestBit(RAMRecord::kDrop) && !TestBit(RAMRecord::kIlluminaBinning))
+         v_qual[0] = '*';
+   } else if (TestBit(RAMRecord::kIlluminaBinning)) {
+      RAMKernels::BinQUAL(qual, v_lseq, v_qual, 0);
+   } else {
+      RAMKernels::ShiftQUAL(qual, v_lseq, v_qual, 33);
    }
+}
 
-   if (qual == nullptr && v_lseq) {
-      maxlqual = v_lseq;
-      qual = new char[v_lseq+1];
-      qual[v_lseq] = '\0';
+inline Int_t RAMRecord::GetQUAL(char *qual, Int_t size) const
+{
+   // Decode QUALity into qual, a buffer of size characters. Returns the
+   // length of the QUALity string, see GetSEQ(char*,Int_t) for how a too
+   // small buffer is handled. See also SetQUAL().
+
+   // in case column v_qual is not read
+   Int_t lqual = v_qual ? v_lseq : 0;
+   bool  drop  = !TestBit(RAMRecord::kPhred33) && !TestBit(RAMRecord::kIlluminaBinning) &&
+                 TestBit(RAMRecord::kDrop);
+   // a missing QUALity is stored as '*' padded with 0's
+   if (lqual && (drop || (!TestBit(RAMRecord::kIlluminaBinning) && v_qual[0] == '*' &&
+                          (lqual == 1 || v_qual[1] == 0))))
+      lqual = 1;
+   if (size <= lqual) {
+      if (size > 0)
+         qual[0] = '\0';
+      return lqual;
    }
 
    if (TestBit(RAMRecord::kPhred33)) {
-      memcpy(qual, v_qual, v_lseq);
+      memcpy(qual, v_qual, lqual);
    } else if (TestBit(RAMRecord::kIlluminaBinning)) {
-      for (int i = 0; i < v_lseq; i++)
-         qual[i] = v_qual[i]+33;   // make printable
-   } else if (TestBit(RAMRecord::kDrop)) {
-      strlcpy(qual, "*", v_lseq+1);
+      RAMKernels::ShiftQUAL(v_qual, lqual, (UChar_t *) qual, 33);   // make printable
+   } else if (drop) {
+      qual[0] = '*';
    } else
-      memcpy(qual, v_qual, v_lseq);
+      memcpy(qual, v_qual, lqual);
+   qual[lqual] = '\0';
 
-   return qual;
+   return lqual;
+}
+
+inline const char *RAMRecord::GetQUAL() const
+{
+   // Decode QUALity into a per thread buffer, valid until the next call in
+   // the same thread. See GetQUAL(char*,Int_t).
+
+   thread_local std::vector<char> qual(256);
+   Int_t len = GetQUAL(qual.data(), qual.size());
+   if (len >= (Int_t) qual.size()) {
+      qual.resize(len + 1);
+      GetQUAL(qual.data(), qual.size());
+   }
+   return qual.data();
 }
 
 
 static const char *codetocigar = "MIDNSHP=X";
 
-inline void RAMRecord::SetCIGAR(const char *cigar)
+inline void RAMRecord::SetCIGAR(const char *cigar, Int_t len)
 {
-   // Use BAM like encoding for the CIGAR code.
-
-   static UChar_t cigartocode[256];
-   static UChar_t iscigarcode[256];
-   static bool init = false;
-   if (!init) {
-      memset(cigartocode, 0, 256);
-      memset(iscigarcode, 0, 256);
-      for (int i = 0; i < 9; i++) {
-         cigartocode[codetocigar[i]] = i;
-         iscigarcode[codetocigar[i]] = 1;
+   // Use BAM like encoding for the CIGAR code. The CIGAR string is parsed
+   // in place, it does not need to be 0 terminated.
+
+   // thread safe one-time initialization of the encoding tables
+   struct CigarToCode {
+      UChar_t fCode[256];
+      UChar_t fIsCode[256];
+      CigarToCode() {
+         memset(fCode, 0, 256);
+         memset(fIsCode, 0, 256);
+         for (int i = 0; i < 9; i++) {
+            fCode[(UChar_t)codetocigar[i]] = i;
+            fIsCode[(UChar_t)codetocigar[i]] = 1;
+         }
       }
-      init = true;
+   };
+   static const CigarToCode table;
+   const UChar_t *cigartocode = table.fCode;
+   const UChar_t *iscigarcode = table.fIsCode;
+
+   // there are never more operations than characters
+   Int_t maxops = len;
+   if (v_cigar != nullptr && maxops > fCigarSize) {
+      delete [] v_cigar;
+      v_cigar = nullptr;
    }
-
-   static int maxops = 1024;   // more than enough
    if (v_cigar == nullptr) {
-      v_cigar = new UInt_t[maxops];
+      fCigarSize = maxops > 16 ? maxops : 16;
+      v_cigar = new UInt_t[fCigarSize];
    }
 
-   int len = strlen(cigar);
-   char cig[1024];             // more than enough
-   strlcpy(cig, cigar, 1024);
    v_ncigar_op = 0;
-   char *c = cig;
+   UInt_t oplen = 0;
    for (int i = 0; i < len; i++) {
-      if (iscigarcode[cig[i]] == 1) {
-         UChar_t op = cigartocode[cig[i]];
-         cig[i] = 0;
-         UInt_t oplen = atoi(c);
-         v_cigar[v_ncigar_op] = (oplen << 4) | op;
+      UChar_t c = cigar[i];
+      if (c >= '0' && c <= '9') {
+         oplen = oplen * 10 + (c - '0');
+      } else if (iscigarcode[c] == 1) {
+         v_cigar[v_ncigar_op] = (oplen << 4) | cigartocode[c];
          v_ncigar_op++;
-         if (v_ncigar_op > maxops) {
-            Error("SetCIGAR", "please increase maxops, currently %d", maxops);
-            return;
-         }
-         c = &cig[i+1];
+         oplen = 0;
       }
    }
 }
 
-inline Int_t RAMRecord::GetCIGAROPLEN(Int_t idx)
+inline void RAMRecord::SetCIGAR(const UInt_t *cigar, Int_t nops)
+{
+   // Set the CIGAR from nops BAM encoded (op_len<<4|op) operations.
+
+   if (v_cigar != nullptr && nops > fCigarSize) {
+      delete [] v_cigar;
+      v_cigar = nullptr;
+   }
+   if (v_cigar == nullptr) {
+      fCigarSize = nops > 16 ? nops : 16;
+      v_cigar = new UInt_t[fCigarSize];
+   }
+
+   memcpy(v_cigar, cigar, nops*sizeof(UInt_t));
+   v_ncigar_op = nops;
+}
+
+inline Int_t RAMRecord::GetCIGAROPLEN(Int_t idx) const
 {
    // Return the length of the CIGAR operation specified by idx.
 
@@ -518,7 +853,7 @@ inline Int_t RAMRecord::GetCIGAROPLEN(Int_t idx)
    return v_cigar[idx] >> 4;
 }
 
-inline Int_t RAMRecord::GetCIGAROP(Int_t idx)
+inline Int_t RAMRecord::GetCIGAROP(Int_t idx) const
 {
    // Return opcode of the CIGAR operation specified by idx.
 
@@ -530,43 +865,90 @@ inline Int_t RAMRecord::GetCIGAROP(Int_t idx)
    return v_cigar[idx] & 0xf;
 }
 
-inline const char *RAMRecord::GetCIGAR() const
+inline Int_t RAMRecord::GetEND() const
 {
-   // Rebuild the CIGAR string.
+   // Return the 0-based position one past the last aligned base, computed
+   // from the reference consuming CIGAR operations (M, D, N, = and X).
+   // Records without CIGAR span one base.
 
-   static char cigar[1024];
+   return v_pos + GetSpan(v_cigar, v_cigar ? v_ncigar_op : 0);
+}
 
-   // in case column v_cigar is not read
-   if (!v_cigar)
-      return "";
-
-   int l = 0;
-   for (int i = 0; i < v_ncigar_op; i++) {
-      l += snprintf(cigar+l, 1024, "%u%c", v_cigar[i] >> 4, codetocigar[v_cigar[i] & 0xf]);
-      if (l > 1024-11) {  // 9 decimals in 28 bits + 1 for op + 1 for trailing 0
-         Error("GetCIGAR", "please increase cigar string, currently %d", 1024);
-         return cigar;
+inline Int_t RAMRecord::GetSpan(const UInt_t *cigar, Int_t ncigar)
+{
+   // Return the number of reference bases covered by the ncigar operations
+   // of cigar, at least 1, see GetEND().
+
+   Int_t span = 0;
+   for (int i = 0; i < ncigar; i++) {
+      switch (cigar[i] & 0xf) {
+         case RAM_CIGAR_M:
+         case RAM_CIGAR_D:
+         case RAM_CIGAR_N:
+         case RAM_CIGAR_EQUAL:
+         case RAM_CIGAR_X:
+            span += cigar[i] >> 4;
       }
    }
-   return cigar;
+   return span > 0 ? span : 1;
 }
 
-inline void RAMRecord::SetOPT(const char *opt)
+inline Int_t RAMRecord::GetCIGAR(char *cigar, Int_t size) const
 {
-   // Set the optional fields.
+   // Rebuild the CIGAR string into cigar, a buffer of size characters.
+   // Returns the length of the CIGAR string, see GetSEQ(char*,Int_t) for
+   // how a too small buffer is handled.
 
-   static int maxopt = 30;    // hopefully enough
-   if (v_opt == nullptr) {
-      v_opt = new TString[maxopt];
+   // in case column v_cigar is not read
+   Int_t nops = v_cigar ? v_ncigar_op : 0;
+
+   Int_t l = 0;
+   for (int i = 0; i < nops; i++) {
+      char op[12];   // 9 decimals in 28 bits + 1 for op + 1 for trailing 0
+      int n = snprintf(op, sizeof(op), "%u%c", v_cigar[i] >> 4, codetocigar[v_cigar[i] & 0xf]);
+      if (l + n < size)
+         memcpy(cigar + l, op, n);
+      l += n;
    }
+   if (l < size)
+      cigar[l] = '\0';
+   else if (size > 0)
+      cigar[0] = '\0';
 
-   if (v_nopt >= maxopt) {
-      // TODO: resize array
-      Error("SetOPT", "please increase maxopt to, at least, %d, currently %d", v_nopt, maxopt);
-      return;
+   return l;
+}
+
+inline const char *RAMRecord::GetCIGAR() const
+{
+   // Rebuild the CIGAR string into a per thread buffer, valid until the
+   // next call in the same thread. See GetCIGAR(char*,Int_t).
+
+   thread_local std::vector<char> cigar(256);
+   Int_t len = GetCIGAR(cigar.data(), cigar.size());
+   if (len >= (Int_t) cigar.size()) {
+      cigar.resize(len + 1);
+      GetCIGAR(cigar.data(), cigar.size());
+   }
+   return cigar.data();
+}
+
+inline void RAMRecord::SetOPT(const char *opt, Int_t len)
+{
+   // Add an optional field, e.g. "NM:i:3". The array of fields grows as
+   // needed, the fields are reused by the next record.
+
+   if (v_opt == nullptr || v_nopt >= fOptSize) {
+      Int_t size = std::max(2 * v_nopt, 16);
+      TString *opt = new TString[size];
+      for (int i = 0; i < v_nopt; i++)
+         std::swap(opt[i], v_opt[i]);
+      delete [] v_opt;
+      v_opt    = opt;
+      fOptSize = size;
    }
 
-   v_opt[v_nopt] = opt;
+   v_opt[v_nopt].Resize(0);
+   v_opt[v_nopt].Append(opt, len);
    v_nopt++;
 }
 
@@ -582,14 +964,47 @@ inline const char *RAMRecord::GetOPT(Int_t idx) const
    return v_opt[idx];
 }
 
-inline void RAMRecord::Print(Option_t *) const
+inline const char *RAMRecord::GetTag(const char *tag, char *type) const
 {
-   // Print a single record, in SAM format.
+   // Return the value of the optional field tag, e.g. "NM", 0 when the
+   // record doesn't have it. Its SAM type (A, i, f, Z, H or B) is stored in
+   // type, when given.
+
+   for (int i = 0; i < v_nopt; i++) {
+      const TString &opt = v_opt[i];
+      if (opt.Length() >= 5 && opt[0] == tag[0] && opt[1] == tag[1] && opt[2] == ':' && opt[4] == ':') {
+         if (type)
+            *type = opt[3];
+         return opt.Data() + 5;
+      }
+   }
+   return nullptr;
+}
 
-   std::cout << GetQNAME() << "\t" << GetFLAG() << "\t" << GetRNAME() << "\t"
-             << GetPOS()+1 << "\t" << GetMAPQ() << "\t" << GetCIGAR() << "\t"
-             << GetRNEXT() << "\t" << GetPNEXT()+1 << "\t" << GetTLEN() << "\t"
-             << GetSEQ() << "\t" << GetQUAL();
+inline bool RAMRecord::GetTag(const char *tag, Long64_t &value) const
+{
+   // Get the value of the integer optional field tag, e.g. GetTag("NM", nm).
+   // Returns false when the record doesn't have tag or it is not an integer.
+
+   char type;
+   const char *v = GetTag(tag, &type);
+   if (!v || type != 'i')
+      return false;
+   char *end;
+   value = strtoll(v, &end, 10);
+   return end != v && *end == '\0';
+}
+
+inline void RAMRecord::Print(Option_t *) const
+{
+   // Print a single record, in SAM format, with the refs read by GetTree().
+   // An empty CIGAR, SEQ or QUAL is printed as "*", like SAMFormatter does.
+
+   auto field = [](const char *v) { return *v ? v : "*"; };
+   std::cout << GetQNAME() << "\t" << GetFLAG() << "\t" << GetRNAME(fgRnameRefs) << "\t"
+             << GetPOS()+1 << "\t" << GetMAPQ() << "\t" << field(GetCIGAR()) << "\t"
+             << GetRNEXT(fgRnameRefs, fgRnextRefs) << "\t" << GetPNEXT()+1 << "\t" << GetTLEN() << "\t"
+             << field(GetSEQ()) << "\t" << field(GetQUAL());
    for (int i = 0; i < GetNOPT(); i++)
       std::cout << "\t" << GetOPT(i);
    std::cout << std::endl;
@@ -599,7 +1014,11 @@ inline void RAMRecord::Print(Option_t *) const
 #ifdef __ROOTCLING__
 #pragma link C++ class RAMRecord+;
 #pragma link C++ class RAMRefs+;
+#pragma link C++ class RAMIndexRef+;
 #pragma link C++ class RAMIndex+;
+#pragma link C++ class RAMBinIndexRef+;
+#pragma link C++ class RAMBinIndex+;
+#pragma link C++ class RAMZoneMap+;
 #endif
 
 #endif
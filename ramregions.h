@@ -0,0 +1,170 @@
+//
+// Genomic regions for queries on RAM files. Regions are given as strings
+// (rname, rname:pos or rname:pos1-pos2, 1-based, inclusive) or read from
+// a BED file (chrom, start, end, 0-based, half-open). Internally a region
+// is 0-based and half-open.
+//
+
+#ifndef RAMRegions_h
+#define RAMRegions_h
+
+#include <TString.h>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "ramrecord.h"
+
+
+struct RAMRegion {
+   TString  fRname;   // reference sequence name
+   Int_t    fRefId;   // refid of fRname, -1 when not in the file
+   Int_t    fStart;   // 0-based start
+   Int_t    fEnd;     // 0-based end, exclusive
+};
+
+
+static bool ParseRegion(const char *query, TString &rname, Int_t &range_start, Int_t &range_end)
+{
+   // Parse a region string: rname:pos1-pos2 (1-based, inclusive), rname:pos1
+   // (till the end of rname) or rname (all of it). The last ':' separates
+   // the positions, so reference names may contain ':' and '-'. Returns
+   // false on a malformed or out of range position.
+
+   std::string region = query;
+   range_start = 1;
+   range_end   = RAMBinIndex::kMaxPos;
+
+   auto colon = region.rfind(':');
+   if (colon == std::string::npos || region.find_first_not_of("0123456789,-", colon + 1) != std::string::npos) {
+      rname = region.c_str();
+      return !region.empty();
+   }
+   rname = region.substr(0, colon).c_str();
+
+   std::string range;
+   for (auto c : region.substr(colon + 1))
+      if (c != ',')
+         range += c;
+   auto position = [](const std::string &s, Int_t &pos) {
+      char *end;
+      errno = 0;
+      long v = strtol(s.c_str(), &end, 10);
+      if (end == s.c_str() || *end || errno == ERANGE || v < 0 || v > INT_MAX)
+         return false;
+      pos = (Int_t) v;
+      return true;
+   };
+   auto dash = range.find('-');
+   if (range.empty() || dash == 0 || !position(range.substr(0, dash), range_start))
+      return false;
+   if (dash != std::string::npos && dash + 1 < range.size() && !position(range.substr(dash + 1), range_end))
+      return false;
+   return range_start > 0 && range_start <= range_end;
+}
+
+static bool ReadRegions(const char *spec, std::vector<RAMRegion> &regions)
+{
+   // Append to regions the regions of spec, either the name of a BED file
+   // or a whitespace separated list of region strings. Browser, track and
+   // comment lines in BED files are skipped. Returns false on a malformed
+   // region, which is reported.
+
+   std::ifstream bed(spec);
+   if (bed) {
+      std::string line;
+      int nline = 0;
+      while (std::getline(bed, line)) {
+         nline++;
+         if (line.empty() || line[0] == '#' || !line.compare(0, 5, "track") || !line.compare(0, 7, "browser"))
+            continue;
+         std::istringstream fields(line);
+         std::string chrom;
+         Long64_t start, end;
+         if (!(fields >> chrom >> start >> end) || start < 0 || end < start) {
+            ::Error("ReadRegions", "%s:%d: malformed BED line", spec, nline);
+            return false;
+         }
+         regions.push_back({chrom.c_str(), -1, (Int_t) std::min<Long64_t>(start, RAMBinIndex::kMaxPos),
+                            (Int_t) std::min<Long64_t>(end, RAMBinIndex::kMaxPos)});
+      }
+      return true;
+   }
+
+   std::istringstream list(spec);
+   std::string query;
+   while (list >> query) {
+      RAMRegion reg;
+      if (!ParseRegion(query.c_str(), reg.fRname, reg.fStart, reg.fEnd)) {
+         ::Error("ReadRegions", "invalid region %s", query.c_str());
+         return false;
+      }
+      reg.fRefId = -1;
+      reg.fStart--;
+      regions.push_back(reg);
+   }
+   return true;
+}
+
+static bool ClampRegion(RAMRegion &reg, const RAMRefs *refs)
+{
+   // Clamp the end of the resolved region reg to the length of its
+   // reference. Returns false, with a warning, when reg starts beyond the
+   // end of the reference. Without known length reg is not changed.
+
+   Int_t length = refs->GetRefLength(reg.fRefId);
+   if (length <= 0)
+      return true;
+   if (reg.fStart >= length) {
+      ::Warning("ClampRegion", "region %s:%d-%d starts beyond the end of the reference (%d)", reg.fRname.Data(),
+                reg.fStart + 1, reg.fEnd, length);
+      return false;
+   }
+   if (reg.fEnd > length)
+      reg.fEnd = length;
+   return true;
+}
+
+static void MergeRegions(std::vector<RAMRegion> &regions, const RAMRefs *refs, bool merge = true)
+{
+   // Resolve the reference names via refs, drop the empty regions and the
+   // ones on references not in the file, then sort the regions in file
+   // order (refid, start) and, unless !merge, merge overlapping and
+   // adjacent ones. Regions are clamped to the reference length, when known.
+
+   size_t n = 0;
+   for (auto &reg : regions) {
+      reg.fRefId = refs->FindRefId(reg.fRname);
+      if (reg.fRefId < 0) {
+         ::Warning("MergeRegions", "reference %s not in file", reg.fRname.Data());
+         continue;
+      }
+      if (!ClampRegion(reg, refs))
+         continue;
+      if (reg.fStart < reg.fEnd)
+         regions[n++] = reg;
+   }
+   regions.resize(n);
+
+   std::sort(regions.begin(), regions.end(), [](const RAMRegion &a, const RAMRegion &b) {
+      return a.fRefId < b.fRefId || (a.fRefId == b.fRefId && a.fStart < b.fStart);
+   });
+   if (!merge)
+      return;
+
+   n = 0;
+   for (size_t i = 0; i < regions.size(); i++) {
+      if (n > 0 && regions[i].fRefId == regions[n-1].fRefId && regions[i].fStart <= regions[n-1].fEnd)
+         regions[n-1].fEnd = std::max(regions[n-1].fEnd, regions[i].fEnd);
+      else
+         regions[n++] = regions[i];
+   }
+   regions.resize(n);
+}
+
+#endif
@@ -0,0 +1,539 @@
+//
+// ramtools is the native command line interface to the RAM tools: one
+// program with a subcommand per macro, linked with libramtools and its
+// precompiled dictionaries, so a command doesn't pay for starting the
+// interpreter and compiling the macro. Build it with make, see the
+// Makefile, and run "ramtools <command> -h" for the options of a command.
+//
+//    ramtools view    [-@ threads] [-o out.sam] [-H] [-f INT] [-F INT] [-q INT] [-s] in.root region...
+//    ramtools convert [-@ threads] [-o out.root] [-v version] [-a algorithm] [-c spec] [-Q policy] [-n] in.sam|in.bam
+//    ramtools merge   [-@ threads] -o out.root [-v version] [-a algorithm] [-n] [-C] in1.root in2.root...
+//    ramtools random  [-o out.txt] [-n count] in.root
+//    ramtools random  -s fraction|-c count [-S seed] [-@ threads] -o out.root [-v version] [-a algorithm] in.root
+//    ramtools index   in.root...
+//    ramtools depth   [-@ threads] [-o out.txt] [-m mode] [-a] [-f INT] [-F INT] [-q INT] in.root [region...]
+//    ramtools stats   [-@ threads] [-o out.json] in.root
+//    ramtools serve   [-@ threads] [-m MB] [-S socket] [-l]
+//    ramtools client  [-S socket] [-o out.sam] [-H] in.root region... | -s | -k
+//
+
+#include <TROOT.h>
+#include <Compression.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "samtoram.C"
+#include "bamtoram.C"
+#include "ramview.C"
+#include "ramview_regions.C"
+#include "rammerge.C"
+#include "ramrandom.C"
+#include "ramindex.C"
+#include "ramdepth.C"
+#include "ramsubsample.C"
+#include "ramstats.C"
+#include "ramd.C"
+
+
+static bool ParseInt(const char *arg, Long64_t min, Long64_t max, Long64_t &value)
+{
+   // Parse the integer arg, decimal or 0x hexadecimal, in [min,max].
+
+   char *end;
+   errno = 0;
+   value = strtoll(arg, &end, 0);
+   if (errno || end == arg || *end || value < min || value > max) {
+      fprintf(stderr, "ramtools: invalid number %s, expected %lld to %lld\n", arg, min, max);
+      return false;
+   }
+   return true;
+}
+
+static bool ParseAlgorithm(const char *arg, Int_t &algorithm)
+{
+   // Compression algorithm by name, e.g. "lzma", see RAMColumns::SetCompression().
+
+   static const struct { const char *fName; Int_t fAlgorithm; } algs[] = {
+      { "zlib", ROOT::kZLIB }, { "lzma", ROOT::kLZMA }, { "lz4", ROOT::kLZ4 }, { "zstd", ROOT::kZSTD } };
+   for (auto &a : algs) {
+      if (!strcasecmp(arg, a.fName)) {
+         algorithm = a.fAlgorithm;
+         return true;
+      }
+   }
+   fprintf(stderr, "ramtools: invalid compression algorithm %s, expected zlib, lzma, lz4 or zstd\n", arg);
+   return false;
+}
+
+static bool ParseQualityPolicy(const char *arg, UInt_t &policy)
+{
+   // Comma separated quality policy bits, e.g. "phred33,codec".
+
+   static const struct { const char *fName; UInt_t fBit; } bits[] = {
+      { "phred33", RAMRecord::kPhred33 }, { "illumina", RAMRecord::kIlluminaBinning },
+      { "drop", RAMRecord::kDrop }, { "codec", RAMRecord::kQualCodec } };
+   policy = 0;
+   std::string list = arg;
+   size_t from = 0;
+   while (from <= list.size()) {
+      size_t to = std::min(list.find(',', from), list.size());
+      std::string name = list.substr(from, to - from);
+      bool found = false;
+      for (auto &b : bits) {
+         if (name == b.fName) {
+            policy |= b.fBit;
+            found = true;
+         }
+      }
+      if (!found) {
+         fprintf(stderr, "ramtools: invalid quality policy %s, expected phred33, illumina, drop or codec\n",
+                 name.c_str());
+         return false;
+      }
+      from = to + 1;
+   }
+   return true;
+}
+
+static bool RedirectStdout(const char *file)
+{
+   // Make file the standard output, SAMFormatter writes to file descriptor 1.
+
+   int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+      fprintf(stderr, "ramtools: cannot write %s: %s\n", file, strerror(errno));
+      return false;
+   }
+   close(fd);
+   return true;
+}
+
+static void EnableThreads(Int_t nthreads)
+{
+   // Compress or decompress the baskets with nthreads threads.
+
+   if (nthreads > 1) {
+      ROOT::EnableThreadSafety();
+      ROOT::EnableImplicitMT(nthreads);
+   }
+}
+
+static int View(int argc, char **argv)
+{
+   const char *usage =
+      "Usage: ramtools view [options] in.root region [region ...]\n"
+      "Write the records overlapping the regions, rname[:pos1[-pos2]] or a BED file, as SAM.\n"
+      "  -@ INT   number of threads for several regions [1]\n"
+      "  -o FILE  output file [stdout]\n"
+      "  -H       also write the SAM header\n"
+      "  -f INT   only records with all bits of INT in FLAG [0]\n"
+      "  -F INT   only records with none of the bits of INT in FLAG [0]\n"
+      "  -q INT   only records with MAPQ at least INT [0]\n"
+      "  -s       use the sampled (refid,pos) index instead of the binned index\n";
+
+   Long64_t nthreads = 1, required = 0, filtered = 0, minmapq = 0;
+   const char *out = nullptr;
+   bool header = false, binindex = true;
+   int c;
+   while ((c = getopt(argc, argv, "@:o:Hf:F:q:sh")) != -1) {
+      switch (c) {
+         case '@': if (!ParseInt(optarg, 1, 1024, nthreads)) return 1; break;
+         case 'o': out = optarg; break;
+         case 'H': header = true; break;
+         case 'f': if (!ParseInt(optarg, 0, 0xffff, required)) return 1; break;
+         case 'F': if (!ParseInt(optarg, 0, 0xffff, filtered)) return 1; break;
+         case 'q': if (!ParseInt(optarg, 0, 255, minmapq)) return 1; break;
+         case 's': binindex = false; break;
+         case 'h': fputs(usage, stdout); return 0;
+         default:  fputs(usage, stderr); return 1;
+      }
+   }
+   if (argc - optind < 2) {
+      fputs(usage, stderr);
+      return 1;
+   }
+   const char *file = argv[optind++];
+   if (out && !RedirectStdout(out))
+      return 1;
+
+   // a single region is viewed with ramview, several or a BED file with ramview_regions
+   bool single = argc - optind == 1 && access(argv[optind], R_OK) != 0;
+   if (single && nthreads == 1) {
+      ramview(file, argv[optind], true, false, "perf.root", binindex, header, required, filtered, minmapq);
+      return 0;
+   }
+   if (required || filtered || minmapq || !binindex) {
+      fprintf(stderr, "ramtools view: -f, -F, -q and -s apply to a single region without -@\n");
+      return 1;
+   }
+   std::string regions;
+   for (int i = optind; i < argc; i++)
+      regions += std::string(i > optind ? " " : "") + argv[i];
+   ramview_regions(file, regions.c_str(), nthreads, true, header);
+   return 0;
+}
+
+static int Convert(int argc, char **argv)
+{
+   const char *usage =
+      "Usage: ramtools convert [options] in.sam|in.bam\n"
+      "Convert a SAM or BAM file, - for SAM from stdin, to a RAM file.\n"
+      "  -@ INT   number of threads [1]\n"
+      "  -o FILE  output file [input with extension .root]\n"
+      "  -v INT   RAM file version, 1 or 2 [2]\n"
+      "  -a STR   compression algorithm, zlib, lzma, lz4 or zstd [lzma]\n"
+      "  -c STR   compression of the columns, e.g. qual=lzma:9,qname=zstd:5, qname=tokenize\n"
+      "           codes QNAME with the name codec\n"
+      "  -Q STR   quality policy, comma separated phred33, illumina, drop, codec [phred33]\n"
+      "  -n       don't build the indices\n";
+
+   Long64_t nthreads = 1, version = 2;
+   Int_t algorithm = ROOT::kLZMA;
+   UInt_t policy = RAMRecord::kPhred33;
+   const char *out = nullptr, *compression = nullptr;
+   bool index = true;
+   int c;
+   while ((c = getopt(argc, argv, "@:o:v:a:c:Q:nh")) != -1) {
+      switch (c) {
+         case '@': if (!ParseInt(optarg, 1, 1024, nthreads)) return 1; break;
+         case 'o': out = optarg; break;
+         case 'v': if (!ParseInt(optarg, 1, 2, version)) return 1; break;
+         case 'a': if (!ParseAlgorithm(optarg, algorithm)) return 1; break;
+         case 'c': compression = optarg; break;
+         case 'Q': if (!ParseQualityPolicy(optarg, policy)) return 1; break;
+         case 'n': index = false; break;
+         case 'h': fputs(usage, stdout); return 0;
+         default:  fputs(usage, stderr); return 1;
+      }
+   }
+   if (argc - optind != 1) {
+      fputs(usage, stderr);
+      return 1;
+   }
+   std::string in = argv[optind], outfile;
+   size_t dot = in.find_last_of('.');
+   bool bam = dot != std::string::npos && in.substr(dot) == ".bam";
+   if (out)
+      outfile = out;
+   else if (in == "-") {
+      fprintf(stderr, "ramtools convert: -o is required when reading stdin\n");
+      return 1;
+   } else
+      outfile = (dot != std::string::npos && in.find('/', dot) == std::string::npos ? in.substr(0, dot) : in) +
+                ".root";
+
+   if (bam)
+      bamtoram(in.c_str(), outfile.c_str(), index, true, true, algorithm, policy, nthreads, version, compression);
+   else
+      samtoram(in.c_str(), outfile.c_str(), index, true, true, algorithm, policy, nthreads, version, compression);
+   return 0;
+}
+
+static int Merge(int argc, char **argv)
+{
+   const char *usage =
+      "Usage: ramtools merge [options] -o out.root in1.root in2.root [...]\n"
+      "Merge coordinate sorted RAM files.\n"
+      "  -@ INT   number of threads compressing the baskets [1]\n"
+      "  -o FILE  output file\n"
+      "  -v INT   RAM file version, 1 or 2 [2]\n"
+      "  -a STR   compression algorithm, zlib, lzma, lz4 or zstd [lzma]\n"
+      "  -n       don't build the indices\n"
+      "  -C       don't copy inputs in compressed form\n";
+
+   Long64_t nthreads = 1, version = 2;
+   Int_t algorithm = ROOT::kLZMA;
+   const char *out = nullptr;
+   bool index = true, fast = true;
+   int c;
+   while ((c = getopt(argc, argv, "@:o:v:a:nCh")) != -1) {
+      switch (c) {
+         case '@': if (!ParseInt(optarg, 1, 1024, nthreads)) return 1; break;
+         case 'o': out = optarg; break;
+         case 'v': if (!ParseInt(optarg, 1, 2, version)) return 1; break;
+         case 'a': if (!ParseAlgorithm(optarg, algorithm)) return 1; break;
+         case 'n': index = false; break;
+         case 'C': fast = false; break;
+         case 'h': fputs(usage, stdout); return 0;
+         default:  fputs(usage, stderr); return 1;
+      }
+   }
+   if (!out || argc - optind < 1) {
+      fputs(usage, stderr);
+      return 1;
+   }
+   std::string infiles;
+   for (int i = optind; i < argc; i++)
+      infiles += std::string(i > optind ? " " : "") + argv[i];
+   EnableThreads(nthreads);
+   return rammerge(out, infiles.c_str(), fast, index, algorithm, version) < 0 ? 1 : 0;
+}
+
+static int Random(int argc, char **argv)
+{
+   const char *usage =
+      "Usage: ramtools random [options] in.root\n"
+      "Print randomly chosen records, or with -s or -c write a subsample to the RAM file -o,\n"
+      "keeping or dropping all records of a template (QNAME) together.\n"
+      "  -o FILE  output file [stdout]\n"
+      "  -n INT   number of records to print [10]\n"
+      "  -s FLOAT fraction of the templates to keep\n"
+      "  -c INT   keep at most INT records\n"
+      "  -S INT   seed of the subsample [0]\n"
+      "  -@ INT   number of threads for the subsample [1]\n"
+      "  -v INT   RAM file version of the subsample, 1 or 2 [2]\n"
+      "  -a STR   compression algorithm, zlib, lzma, lz4 or zstd [lzma]\n";
+
+   Long64_t n = 10, count = 0, seed = 0, nthreads = 1, version = 2;
+   Double_t fraction = -1;
+   Int_t algorithm = ROOT::kLZMA;
+   const char *out = nullptr;
+   char *end;
+   int c;
+   while ((c = getopt(argc, argv, "o:n:s:c:S:@:v:a:h")) != -1) {
+      switch (c) {
+         case 'o': out = optarg; break;
+         case 'n': if (!ParseInt(optarg, 0, INT_MAX, n)) return 1; break;
+         case 's':
+            fraction = strtod(optarg, &end);
+            if (end == optarg || *end || !(fraction >= 0 && fraction <= 1)) {
+               fprintf(stderr, "ramtools: invalid fraction %s, expected 0 to 1\n", optarg);
+               return 1;
+            }
+            break;
+         case 'c': if (!ParseInt(optarg, 1, LLONG_MAX, count)) return 1; break;
+         case 'S': if (!ParseInt(optarg, 0, LLONG_MAX, seed)) return 1; break;
+         case '@': if (!ParseInt(optarg, 1, 1024, nthreads)) return 1; break;
+         case 'v': if (!ParseInt(optarg, 1, 2, version)) return 1; break;
+         case 'a': if (!ParseAlgorithm(optarg, algorithm)) return 1; break;
+         case 'h': fputs(usage, stdout); return 0;
+         default:  fputs(usage, stderr); return 1;
+      }
+   }
+   bool subsample = fraction >= 0 || count > 0;
+   if (argc - optind != 1 || (subsample && !out)) {
+      fputs(usage, stderr);
+      return 1;
+   }
+   if (subsample) {
+      ramsubsample(argv[optind], out, fraction, count, seed, nthreads, algorithm, version);
+      return 0;
+   }
+   if (out && !RedirectStdout(out))
+      return 1;
+   ramrandom(argv[optind], out ? out : "-", n);
+   return 0;
+}
+
+static int Index(int argc, char **argv)
+{
+   const char *usage =
+      "Usage: ramtools index in.root [...]\n"
+      "Rebuild the sampled and the binned index of RAM files.\n";
+
+   int c;
+   while ((c = getopt(argc, argv, "h")) != -1) {
+      switch (c) {
+         case 'h': fputs(usage, stdout); return 0;
+         default:  fputs(usage, stderr); return 1;
+      }
+   }
+   if (argc - optind < 1) {
+      fputs(usage, stderr);
+      return 1;
+   }
+   for (int i = optind; i < argc; i++)
+      ramindex(argv[i]);
+   return 0;
+}
+
+static int Depth(int argc, char **argv)
+{
+   const char *usage =
+      "Usage: ramtools depth [options] in.root [region ...]\n"
+      "Write the depth of the regions, rname[:pos1[-pos2]] or a BED file, or of all references.\n"
+      "  -@ INT   number of threads [1]\n"
+      "  -o FILE  output file [stdout]\n"
+      "  -m STR   depth (per base), bedgraph (runs of equal depth) or mean (of each region) [depth]\n"
+      "  -a       also write the positions of depth 0\n"
+      "  -f INT   only records with all bits of INT in FLAG [0]\n"
+      "  -F INT   only records with none of the bits of INT in FLAG [0x704]\n"
+      "  -q INT   only records with MAPQ at least INT [0]\n";
+
+   Long64_t nthreads = 1, required = 0, filtered = 0x704, minmapq = 0;
+   const char *out = nullptr, *mode = "depth";
+   bool all = false;
+   int c;
+   while ((c = getopt(argc, argv, "@:o:m:af:F:q:h")) != -1) {
+      switch (c) {
+         case '@': if (!ParseInt(optarg, 1, 1024, nthreads)) return 1; break;
+         case 'o': out = optarg; break;
+         case 'm': mode = optarg; break;
+         case 'a': all = true; break;
+         case 'f': if (!ParseInt(optarg, 0, 0xffff, required)) return 1; break;
+         case 'F': if (!ParseInt(optarg, 0, 0xffff, filtered)) return 1; break;
+         case 'q': if (!ParseInt(optarg, 0, 255, minmapq)) return 1; break;
+         case 'h': fputs(usage, stdout); return 0;
+         default:  fputs(usage, stderr); return 1;
+      }
+   }
+   if (argc - optind < 1) {
+      fputs(usage, stderr);
+      return 1;
+   }
+   if (strcmp(mode, "depth") && strcmp(mode, "bedgraph") && strcmp(mode, "mean")) {
+      fprintf(stderr, "ramtools depth: invalid mode %s, expected depth, bedgraph or mean\n", mode);
+      return 1;
+   }
+   const char *file = argv[optind++];
+   if (out && !RedirectStdout(out))
+      return 1;
+   std::string regions;
+   for (int i = optind; i < argc; i++)
+      regions += std::string(i > optind ? " " : "") + argv[i];
+   ramdepth(file, regions.c_str(), mode, nthreads, required, filtered, minmapq, all);
+   return 0;
+}
+
+static int Stats(int argc, char **argv)
+{
+   const char *usage =
+      "Usage: ramtools stats [options] in.root\n"
+      "Write the flagstat and idxstats counters, the MAPQ histogram and the insert sizes as JSON.\n"
+      "  -@ INT   number of threads [1]\n"
+      "  -o FILE  output file [stdout]\n";
+
+   Long64_t nthreads = 1;
+   const char *out = nullptr;
+   int c;
+   while ((c = getopt(argc, argv, "@:o:h")) != -1) {
+      switch (c) {
+         case '@': if (!ParseInt(optarg, 1, 1024, nthreads)) return 1; break;
+         case 'o': out = optarg; break;
+         case 'h': fputs(usage, stdout); return 0;
+         default:  fputs(usage, stderr); return 1;
+      }
+   }
+   if (argc - optind != 1) {
+      fputs(usage, stderr);
+      return 1;
+   }
+   if (out && !RedirectStdout(out))
+      return 1;
+   ramstats(argv[optind], nthreads);
+   return 0;
+}
+
+static int Serve(int argc, char **argv)
+{
+   const char *usage =
+      "Usage: ramtools serve [options]\n"
+      "Run ramd, serve region queries on RAM files over a Unix domain socket until stopped.\n"
+      "  -@ INT   number of threads [4]\n"
+      "  -m INT   memory budget of the cache of decoded records in MB [512]\n"
+      "  -S FILE  socket [$TMPDIR/ramd-<uid>.sock]\n"
+      "  -l       log every query to stderr\n";
+
+   Long64_t nthreads = 4, cachemb = 512;
+   const char *socket = nullptr;
+   bool verbose = false;
+   int c;
+   while ((c = getopt(argc, argv, "@:m:S:lh")) != -1) {
+      switch (c) {
+         case '@': if (!ParseInt(optarg, 1, 1024, nthreads)) return 1; break;
+         case 'm': if (!ParseInt(optarg, 0, 1 << 24, cachemb)) return 1; break;
+         case 'S': socket = optarg; break;
+         case 'l': verbose = true; break;
+         case 'h': fputs(usage, stdout); return 0;
+         default:  fputs(usage, stderr); return 1;
+      }
+   }
+   if (argc != optind) {
+      fputs(usage, stderr);
+      return 1;
+   }
+   ramd(socket, nthreads, cachemb, verbose);
+   return 0;
+}
+
+static int Client(int argc, char **argv)
+{
+   const char *usage =
+      "Usage: ramtools client [options] in.root region [region ...]\n"
+      "       ramtools client [-S socket] -s | -k\n"
+      "Query a ramd server, see ramtools serve, for the records overlapping the regions,\n"
+      "rname[:pos1[-pos2]] or a BED file, as SAM.\n"
+      "  -S FILE  socket [$TMPDIR/ramd-<uid>.sock]\n"
+      "  -o FILE  output file [stdout]\n"
+      "  -H       include the header\n"
+      "  -s       write the counters of the server as JSON\n"
+      "  -k       stop the server\n";
+
+   const char *socket = nullptr, *out = nullptr, *request = nullptr;
+   bool header = false;
+   int c;
+   while ((c = getopt(argc, argv, "S:o:Hskh")) != -1) {
+      switch (c) {
+         case 'S': socket = optarg; break;
+         case 'o': out = optarg; break;
+         case 'H': header = true; break;
+         case 's': request = "stats"; break;
+         case 'k': request = "stop"; break;
+         case 'h': fputs(usage, stdout); return 0;
+         default:  fputs(usage, stderr); return 1;
+      }
+   }
+   if (request ? argc != optind : argc - optind < 2) {
+      fputs(usage, stderr);
+      return 1;
+   }
+   if (out && !RedirectStdout(out))
+      return 1;
+   if (request)
+      return ramd_request(request, socket);
+   const char *file = argv[optind++];
+   std::string regions;
+   for (int i = optind; i < argc; i++)
+      regions += std::string(i > optind ? " " : "") + argv[i];
+   return ramd_view(file, regions.c_str(), header, socket);
+}
+
+int main(int argc, char **argv)
+{
+   static const struct { const char *fName; int (*fRun)(int, char **); const char *fHelp; } commands[] = {
+      { "view",    View,    "view the records overlapping regions" },
+      { "convert", Convert, "convert a SAM or BAM file to a RAM file" },
+      { "merge",   Merge,   "merge coordinate sorted RAM files" },
+      { "random",  Random,  "print randomly chosen records or subsample" },
+      { "index",   Index,   "rebuild the indices of RAM files" },
+      { "depth",   Depth,   "per base depth and coverage of regions" },
+      { "stats",   Stats,   "flagstat, idxstats, MAPQ and insert size statistics" },
+      { "serve",   Serve,   "run ramd, a query server keeping files and decoded records in memory" },
+      { "client",  Client,  "query a ramd server" } };
+
+   if (argc >= 2) {
+      for (auto &cmd : commands) {
+         if (!strcmp(argv[1], cmd.fName)) {
+            // the options of the command start after its name
+            optind = 1;
+            return cmd.fRun(argc - 1, argv + 1);
+         }
+      }
+   }
+   bool help = argc >= 2 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "help"));
+   FILE *fp = help ? stdout : stderr;
+   if (argc >= 2 && !help)
+      fprintf(stderr, "ramtools: unknown command %s\n\n", argv[1]);
+   fprintf(fp, "Usage: ramtools <command> [options]\n\nCommands:\n");
+   for (auto &cmd : commands)
+      fprintf(fp, "  %-8s %s\n", cmd.fName, cmd.fHelp);
+   fprintf(fp, "\nRun ramtools <command> -h for the options of a command.\n");
+   return help ? 0 : 1;
+}
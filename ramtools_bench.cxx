@@ -0,0 +1,473 @@
+//
+// ramtools_bench is the benchmark suite of the RAM tools, a native program
+// that runs offline on one machine and writes its results as JSON, one
+// result per line, so the reports of two builds can be compared with diff.
+// It generates a synthetic coordinate sorted SAM file, converts it with
+// each compression algorithm and layout (version 1 split and unsplit,
+// version 2 columns) and times on each RAM file a single region and a
+// multi region view, random access and full scans. Every case runs in a
+// forked process, which gives its wall time, CPU time, peak RSS and the
+// bytes and read calls of all its TFiles. The peak RSS includes the few
+// tens of MB of the ROOT libraries loaded by the parent. The best of the
+// repeats, by wall time, is reported. Build and run it with make bench.
+//
+//    ramtools_bench [-n records] [-l length] [-s seed] [-r repeats] [-a algorithms]
+//                   [-@ threads] [-d dir] [-k] [-v] [-o out.json]
+//
+
+#include <TFile.h>
+#include <Compression.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "samtoram.C"
+#include "ramview.C"
+#include "ramview_regions.C"
+#include "ramrandom.C"
+
+
+static const Int_t kNRefs          = 4;         // references of the synthetic genome
+static const Int_t kRefLength      = 25000000;  // length of each reference
+static const Int_t kRegionLength   = 1000000;   // length of the single region view
+static const Int_t kNRegions       = 100;       // regions of the multi region view
+static const Int_t kRegionsLength  = 10000;     // length of each of them
+static const Int_t kRandomRecords  = 1000;      // records read by the random access
+
+// xorshift64* generator, the synthetic data only depends on the seed.
+class BenchRandom {
+private:
+   ULong64_t fState;
+
+public:
+   BenchRandom(ULong64_t seed) : fState(seed ? seed : 0x9e3779b97f4a7c15ULL) { }
+   ULong64_t Next() {
+      fState ^= fState >> 12;
+      fState ^= fState << 25;
+      fState ^= fState >> 27;
+      return fState * 0x2545f4914f6cdd1dULL;
+   }
+   UInt_t Integer(UInt_t n) { return (UInt_t) ((Next() >> 32) % n); }
+};
+
+// Options of the run, shared by the cases.
+struct BenchConfig {
+   Long64_t     fNRecords;
+   Int_t        fLength;
+   ULong64_t    fSeed;
+   Int_t        fRepeats;
+   Int_t        fThreads;
+   bool         fVerbose;
+   std::string  fDir;
+};
+
+// Measurement of one run of a case.
+struct BenchResult {
+   bool      fOk;
+   Double_t  fWall;        // s
+   Double_t  fCpu;         // s, user + system of all threads
+   Long64_t  fBytesRead;   // by all TFiles of the case
+   Long64_t  fReadCalls;
+   Long64_t  fPeakRSS;     // kB
+};
+
+static bool GenerateSAM(const BenchConfig &cfg, const char *file, Long64_t &size)
+{
+   // Write cfg.fNRecords records of length cfg.fLength, sorted by
+   // coordinate over kNRefs references, with a mix of flags, MAPQ, CIGAR
+   // with indels and soft clips, and the NM, AS and RG tags.
+
+   FILE *fp = fopen(file, "w");
+   if (!fp) {
+      fprintf(stderr, "ramtools_bench: cannot write %s: %s\n", file, strerror(errno));
+      return false;
+   }
+   BenchRandom rnd(cfg.fSeed);
+   const Int_t len = cfg.fLength;
+   fprintf(fp, "@HD\tVN:1.6\tSO:coordinate\n");
+   for (Int_t ref = 0; ref < kNRefs; ref++)
+      fprintf(fp, "@SQ\tSN:chr%d\tLN:%d\n", ref + 1, kRefLength);
+   fprintf(fp, "@RG\tID:grp1\tSM:bench\n");
+   fprintf(fp, "@PG\tID:ramtools_bench\tPN:ramtools_bench\n");
+
+   std::string seq(len, 'A'), qual(len, 'I');
+   const char bases[] = "ACGT";
+   char cig[64];
+   Long64_t perref = (cfg.fNRecords + kNRefs - 1) / kNRefs;
+   Long64_t id = 0;
+   for (Int_t ref = 0; ref < kNRefs && id < cfg.fNRecords; ref++) {
+      // the positions step on average by the length of the reference over its records
+      UInt_t step = (UInt_t) std::max(2 * (kRefLength - len) / std::max(perref, 1LL), 1LL);
+      Long64_t pos = 1;
+      for (Long64_t i = 0; i < perref && id < cfg.fNRecords; i++, id++) {
+         pos = std::min(pos + rnd.Integer(step), (Long64_t) kRefLength - len);
+         UInt_t kind = rnd.Integer(100);
+         UInt_t flag = rnd.Integer(2) ? 16 : 0;
+         if (kind < 4)
+            flag |= 0x400;
+         else if (kind < 6)
+            flag |= 0x100;
+         UInt_t mapq = kind < 10 ? rnd.Integer(10) : 20 + rnd.Integer(41);
+         UInt_t nm = 0;
+         if (kind >= 90 && len >= 20) {
+            // a deletion, an insertion and soft clips, the query length stays len
+            Int_t clip = 1 + rnd.Integer(5), ins = 1 + rnd.Integer(3), del = 1 + rnd.Integer(3);
+            Int_t m1 = (len - 2 * clip - ins) / 2, m2 = len - 2 * clip - ins - m1;
+            snprintf(cig, sizeof(cig), "%dS%dM%dD%dI%dM%dS", clip, m1, del, ins, m2, clip);
+            nm = ins + del;
+         } else
+            snprintf(cig, sizeof(cig), "%dM", len);
+         for (Int_t j = 0; j < len; j++) {
+            ULong64_t b = rnd.Next();
+            seq[j]  = bases[b & 3];
+            qual[j] = (char) (33 + 2 + (b >> 8) % 39);
+            if ((b >> 16) % 50 == 0)
+               nm++;
+         }
+         fprintf(fp, "bench:%d:%lld\t%u\tchr%d\t%lld\t%u\t%s\t*\t0\t0\t%s\t%s\tNM:i:%u\tAS:i:%u\tRG:Z:grp1\n",
+                 ref + 1, id, flag, ref + 1, pos, mapq, cig, seq.c_str(), qual.c_str(), nm,
+                 (UInt_t) std::max(len - 4 * (Int_t) nm, 0));
+      }
+   }
+   if (fclose(fp) != 0) {
+      fprintf(stderr, "ramtools_bench: cannot write %s: %s\n", file, strerror(errno));
+      return false;
+   }
+   struct stat st;
+   size = stat(file, &st) == 0 ? st.st_size : 0;
+   return true;
+}
+
+static std::string SingleRegion()
+{
+   // A kRegionLength region in the middle of chr1, 1-based inclusive.
+
+   char region[64];
+   Int_t start = (kRefLength - kRegionLength) / 2;
+   snprintf(region, sizeof(region), "chr1:%d-%d", start + 1, start + kRegionLength);
+   return region;
+}
+
+static std::string MultiRegions(ULong64_t seed)
+{
+   // kNRegions regions of kRegionsLength at random positions of all references.
+
+   BenchRandom rnd(seed + 1);
+   std::string regions;
+   char region[64];
+   for (Int_t i = 0; i < kNRegions; i++) {
+      Int_t start = 1 + rnd.Integer(kRefLength - kRegionsLength);
+      snprintf(region, sizeof(region), "%schr%d:%d-%d", i ? " " : "", 1 + rnd.Integer(kNRefs), start,
+               start + kRegionsLength - 1);
+      regions += region;
+   }
+   return regions;
+}
+
+static void ScanEntries(const char *file)
+{
+   // Read all columns of all records entry by entry.
+
+   RAMFile rf(file);
+   if (!rf.IsOpen())
+      _exit(1);
+   Long64_t nentries = rf.GetEntries();
+   Long64_t sum = 0;
+   for (Long64_t i = 0; i < nentries; i++) {
+      rf.GetEntry(i);
+      sum += rf.GetRecord()->GetSEQLEN();
+   }
+   printf("%lld\n", sum);
+}
+
+static void ScanBatches(const char *file)
+{
+   // Count the primary records with MAPQ at least 30, reading FLAG, REFID,
+   // POS and MAPQ in batches, see batch_bench.C.
+
+   RAMFile rf(file);
+   if (!rf.IsOpen())
+      _exit(1);
+   RAMBatch batch;
+   Long64_t nentries = rf.GetEntries(), selected = 0;
+   for (Long64_t first = 0; first < nentries; first += kBatchSize) {
+      rf.GetBatch(first, kBatchSize, RAMColumns::kFLAG | RAMColumns::kREFID | RAMColumns::kPOS | RAMColumns::kMAPQ,
+                  batch);
+      batch.SelectFlags(0, 0x904);
+      batch.SelectMAPQ(30);
+      selected += batch.GetNSelected();
+   }
+   printf("%lld\n", selected);
+}
+
+template <typename F>
+static BenchResult RunOnce(const BenchConfig &cfg, F run)
+{
+   // Run run() in a child process with stdout, and stderr unless verbose,
+   // redirected to /dev/null.
+
+   BenchResult res = { false, 0, 0, 0, 0, 0 };
+   int fds[2];
+   if (pipe(fds) != 0) {
+      fprintf(stderr, "ramtools_bench: pipe: %s\n", strerror(errno));
+      return res;
+   }
+   fflush(nullptr);
+   auto start = std::chrono::steady_clock::now();
+   pid_t pid = fork();
+   if (pid < 0) {
+      fprintf(stderr, "ramtools_bench: fork: %s\n", strerror(errno));
+      close(fds[0]);
+      close(fds[1]);
+      return res;
+   }
+   if (pid == 0) {
+      close(fds[0]);
+      int null = open("/dev/null", O_WRONLY);
+      dup2(null, STDOUT_FILENO);
+      if (!cfg.fVerbose)
+         dup2(null, STDERR_FILENO);
+      TFile::SetFileBytesRead(0);
+      TFile::SetFileReadCalls(0);
+      run();
+      Long64_t io[2] = { TFile::GetFileBytesRead(), TFile::GetFileReadCalls() };
+      fflush(nullptr);
+      std::cout.flush();
+      bool ok = write(fds[1], io, sizeof(io)) == sizeof(io);
+      _exit(ok ? 0 : 1);
+   }
+   close(fds[1]);
+   Long64_t io[2] = { 0, 0 };
+   bool got = read(fds[0], io, sizeof(io)) == sizeof(io);
+   close(fds[0]);
+   int status;
+   struct rusage ru;
+   while (wait4(pid, &status, 0, &ru) < 0 && errno == EINTR) { }
+   auto stop = std::chrono::steady_clock::now();
+
+   res.fOk        = got && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+   res.fWall      = std::chrono::duration<Double_t>(stop - start).count();
+   res.fCpu       = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + 1e-6 * (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+   res.fBytesRead = io[0];
+   res.fReadCalls = io[1];
+   res.fPeakRSS   = ru.ru_maxrss;
+   return res;
+}
+
+template <typename F>
+static bool RunCase(const BenchConfig &cfg, FILE *json, bool &first, const char *name, const char *params, F run,
+                    const char *outfile = nullptr)
+{
+   // Run the case cfg.fRepeats times and write the best run as a JSON line,
+   // params are the extra "key": value members of the case. With outfile
+   // its size is added as output_bytes.
+
+   BenchResult best = { false, 0, 0, 0, 0, 0 };
+   for (Int_t i = 0; i < cfg.fRepeats; i++) {
+      BenchResult res = RunOnce(cfg, run);
+      if (!res.fOk) {
+         best = res;
+         break;
+      }
+      if (i == 0 || res.fWall < best.fWall)
+         best = res;
+   }
+   Long64_t outsize = -1;
+   struct stat st;
+   if (outfile) {
+      outsize = stat(outfile, &st) == 0 ? st.st_size : 0;
+      if (outsize == 0)
+         best.fOk = false;
+   }
+
+   fprintf(json, "%s    {\"case\": \"%s\", %s, \"ok\": %s, \"wall_s\": %.4f, \"cpu_s\": %.4f, "
+           "\"bytes_read\": %lld, \"read_calls\": %lld, \"peak_rss_kb\": %lld",
+           first ? "" : ",\n", name, params, best.fOk ? "true" : "false", best.fWall, best.fCpu, best.fBytesRead,
+           best.fReadCalls, best.fPeakRSS);
+   if (outfile)
+      fprintf(json, ", \"output_bytes\": %lld", outsize);
+   fprintf(json, "}");
+   first = false;
+   fprintf(stderr, "ramtools_bench: %-12s %-44s %s %8.3f s\n", name, params, best.fOk ? "ok    " : "FAILED",
+           best.fWall);
+   return best.fOk;
+}
+
+static bool ParseInt(const char *arg, Long64_t min, Long64_t max, Long64_t &value)
+{
+   // Parse the integer arg, decimal or 0x hexadecimal, in [min,max].
+
+   char *end;
+   errno = 0;
+   value = strtoll(arg, &end, 0);
+   if (errno || end == arg || *end || value < min || value > max) {
+      fprintf(stderr, "ramtools_bench: invalid number %s, expected %lld to %lld\n", arg, min, max);
+      return false;
+   }
+   return true;
+}
+
+int main(int argc, char **argv)
+{
+   const char *usage =
+      "Usage: ramtools_bench [options]\n"
+      "Benchmark conversion, views, random access and scans of synthetic data, write the results as JSON.\n"
+      "  -n INT   number of SAM records [200000]\n"
+      "  -l INT   read length [100]\n"
+      "  -s INT   seed of the synthetic data [1]\n"
+      "  -r INT   repeats of each case, the fastest is reported [3]\n"
+      "  -a STR   comma separated compression algorithms [zlib,lzma,lz4,zstd]\n"
+      "  -@ INT   number of conversion threads [1]\n"
+      "  -d DIR   directory of the data files [a new directory in $TMPDIR]\n"
+      "  -k       keep the data files\n"
+      "  -v       show the output of the cases on stderr\n"
+      "  -o FILE  JSON output file [stdout]\n";
+
+   static const struct { const char *fName; Int_t fAlgorithm; } algs[] = {
+      { "zlib", ROOT::kZLIB }, { "lzma", ROOT::kLZMA }, { "lz4", ROOT::kLZ4 }, { "zstd", ROOT::kZSTD } };
+   // the layouts of the RAM files: version and split of version 1
+   static const struct { const char *fName; Int_t fVersion; bool fSplit; } layouts[] = {
+      { "v1-split", 1, true }, { "v1-nosplit", 1, false }, { "v2", 2, true } };
+
+   BenchConfig cfg;
+   Long64_t nrecords = 200000, length = 100, seed = 1, repeats = 3, nthreads = 1;
+   std::string algorithms = "zlib,lzma,lz4,zstd";
+   const char *dir = nullptr, *out = nullptr;
+   bool keep = false;
+   cfg.fVerbose = false;
+   int c;
+   while ((c = getopt(argc, argv, "n:l:s:r:a:@:d:kvo:h")) != -1) {
+      switch (c) {
+         case 'n': if (!ParseInt(optarg, 1, 1LL << 40, nrecords)) return 1; break;
+         case 'l': if (!ParseInt(optarg, 1, 10000, length)) return 1; break;
+         case 's': if (!ParseInt(optarg, 0, LLONG_MAX, seed)) return 1; break;
+         case 'r': if (!ParseInt(optarg, 1, 1000, repeats)) return 1; break;
+         case 'a': algorithms = optarg; break;
+         case '@': if (!ParseInt(optarg, 1, 1024, nthreads)) return 1; break;
+         case 'd': dir = optarg; break;
+         case 'k': keep = true; break;
+         case 'v': cfg.fVerbose = true; break;
+         case 'o': out = optarg; break;
+         case 'h': fputs(usage, stdout); return 0;
+         default:  fputs(usage, stderr); return 1;
+      }
+   }
+   if (optind != argc) {
+      fputs(usage, stderr);
+      return 1;
+   }
+   cfg.fNRecords = nrecords;
+   cfg.fLength   = length;
+   cfg.fSeed     = seed;
+   cfg.fRepeats  = repeats;
+   cfg.fThreads  = nthreads;
+
+   std::vector<Int_t> algidx;
+   size_t from = 0;
+   while (from <= algorithms.size()) {
+      size_t to = std::min(algorithms.find(',', from), algorithms.size());
+      std::string name = algorithms.substr(from, to - from);
+      Int_t found = -1;
+      for (Int_t i = 0; i < 4; i++)
+         if (name == algs[i].fName)
+            found = i;
+      if (found < 0) {
+         fprintf(stderr, "ramtools_bench: invalid compression algorithm %s, expected zlib, lzma, lz4 or zstd\n",
+                 name.c_str());
+         return 1;
+      }
+      algidx.push_back(found);
+      from = to + 1;
+   }
+
+   if (dir) {
+      cfg.fDir = dir;
+      if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+         fprintf(stderr, "ramtools_bench: cannot create %s: %s\n", dir, strerror(errno));
+         return 1;
+      }
+   } else {
+      const char *tmp = getenv("TMPDIR");
+      std::string templ = std::string(tmp && *tmp ? tmp : "/tmp") + "/ramtools_bench.XXXXXX";
+      std::vector<char> buf(templ.begin(), templ.end());
+      buf.push_back(0);
+      if (!mkdtemp(buf.data())) {
+         fprintf(stderr, "ramtools_bench: cannot create %s: %s\n", templ.c_str(), strerror(errno));
+         return 1;
+      }
+      cfg.fDir = buf.data();
+   }
+   FILE *json = out ? fopen(out, "w") : stdout;
+   if (!json) {
+      fprintf(stderr, "ramtools_bench: cannot write %s: %s\n", out, strerror(errno));
+      return 1;
+   }
+
+   std::string sam = cfg.fDir + "/bench.sam";
+   Long64_t samsize = 0;
+   fprintf(stderr, "ramtools_bench: generating %lld records of length %d in %s\n", nrecords, cfg.fLength,
+           sam.c_str());
+   if (!GenerateSAM(cfg, sam.c_str(), samsize))
+      return 1;
+
+   fprintf(json, "{\n  \"records\": %lld, \"read_length\": %d, \"seed\": %lld, \"repeats\": %d, "
+           "\"threads\": %d, \"sam_bytes\": %lld,\n  \"results\": [\n",
+           nrecords, cfg.fLength, seed, cfg.fRepeats, cfg.fThreads, samsize);
+
+   std::string region = SingleRegion(), regions = MultiRegions(cfg.fSeed);
+   std::vector<std::string> files;
+   bool first = true, ok = true;
+   char params[128];
+   for (Int_t a : algidx) {
+      for (auto &lay : layouts) {
+         std::string file = cfg.fDir + "/bench_" + algs[a].fName + "_" + lay.fName + ".root";
+         const char *f = file.c_str();
+         files.push_back(file);
+         snprintf(params, sizeof(params), "\"algorithm\": \"%s\", \"layout\": \"%s\"", algs[a].fName, lay.fName);
+
+         // the read cases need the converted file
+         if (!RunCase(cfg, json, first, "convert", params, [&] {
+                samtoram(sam.c_str(), f, true, lay.fSplit, true, algs[a].fAlgorithm, RAMRecord::kPhred33,
+                         cfg.fThreads, lay.fVersion);
+             }, f)) {
+            ok = false;
+            continue;
+         }
+         ok &= RunCase(cfg, json, first, "view", params, [&] {
+            ramview(f, region.c_str(), true, false, "perf.root", true, false);
+         });
+         ok &= RunCase(cfg, json, first, "view-regions", params, [&] {
+            ramview_regions(f, regions.c_str(), 1, true, false);
+         });
+         ok &= RunCase(cfg, json, first, "random", params, [&] {
+            gRandom->SetSeed(cfg.fSeed);
+            ramrandom(f, "-", kRandomRecords);
+         });
+         ok &= RunCase(cfg, json, first, "scan", params, [&] { ScanEntries(f); });
+         ok &= RunCase(cfg, json, first, "scan-batch", params, [&] { ScanBatches(f); });
+      }
+   }
+   fprintf(json, "\n  ]\n}\n");
+   if (out)
+      fclose(json);
+
+   if (!keep) {
+      unlink(sam.c_str());
+      for (auto &file : files)
+         unlink(file.c_str());
+      if (!dir)
+         rmdir(cfg.fDir.c_str());
+   }
+   return ok ? 0 : 1;
+}
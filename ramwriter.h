@@ -0,0 +1,411 @@
+//
+// RAMWriter creates a RAM file: the RAM tree, with a RAMRecord branch
+// (version 1) or a flat branch per SAM field (version 2, see RAMColumns),
+// the SAM headers stored as UserInfo, the refs, the indices and the zone
+// map. The refs and the indices belong to the writer, so several files can
+// be written in the same process. Used by all tools that produce RAM files.
+//
+
+#ifndef RAMWriter_h
+#define RAMWriter_h
+
+#include <TROOT.h>
+#include <TFile.h>
+#include <TTree.h>
+#include <TBranch.h>
+#include <TLeaf.h>
+#include <TBasket.h>
+#include <TTreeCloner.h>
+#include <TList.h>
+#include <TNamed.h>
+#include <TString.h>
+#include <Compression.h>
+#include <ROOT/RStringView.hxx>
+#include <algorithm>
+#include <vector>
+
+#include "ramrecord.h"
+#include "ramcolumns.h"
+#include "ramfile.h"
+
+
+// Enables ROOT's implicit multi-threading with nthreads > 1, to compress
+// the baskets of RAMWriters in parallel, until the object goes out of
+// scope. An enclosing enable, e.g. by the ramtools CLI, is left alone.
+class RAMImplicitMT {
+private:
+   bool fEnabled;   // enabled by this object
+
+public:
+   RAMImplicitMT(Int_t nthreads) : fEnabled(nthreads > 1 && !ROOT::IsImplicitMTEnabled()) {
+      if (fEnabled) {
+         ROOT::EnableThreadSafety();
+         ROOT::EnableImplicitMT(nthreads);
+      }
+   }
+   ~RAMImplicitMT() { if (fEnabled) ROOT::DisableImplicitMT(); }
+};
+
+
+class RAMWriter {
+private:
+   TFile     *fFile;       // output file
+   TTree     *fTree;       // RAM tree
+   RAMRecord *fRecord;     // record connected to the RAMRecord branch, or copied to the columns
+   RAMColumns *fColumns;   // columns of version 2 files, 0 for version 1
+   TList     *fHeaders;    // SAM header lines, stored as UserInfo of fTree
+   RAMRefs   *fRnameRefs;  // refs of RNAME and RNEXT
+   bool       fIndexed;    // fill the RAMIndex, RAMBinIndex and RAMZoneMap
+   RAMIndex  *fIndex;      // sampled index, filled when fIndexed
+   RAMBinIndex *fBinIndex; // binned index, filled when fIndexed
+   RAMZoneMap *fZoneMap;   // per cluster statistics, filled when fIndexed
+   Long64_t   fEntries;    // number of records filled
+   Long64_t   fUnsorted;   // entry of the input of the last copy out of coordinate order, -1 if none
+
+   void       IndexCopied(RAMFile &in, Long64_t first, Long64_t n);
+   void       IncludeRanges(TTree *tree);
+
+public:
+   RAMWriter(const char *file, const char *title, bool index = true, bool split = true, bool cache = true,
+             Int_t compression_algorithm = ROOT::kLZMA, UInt_t quality_policy = RAMRecord::kPhred33,
+             Int_t version = 2, const char *compression = nullptr);
+   ~RAMWriter() { Close(); }
+
+   bool       IsOpen() const { return fFile != nullptr; }
+   TTree     *GetTree() const { return fTree; }
+   RAMRecord *GetRecord() const { return fRecord; }
+   TList     *GetHeaders() const { return fHeaders; }
+   RAMRefs   *GetRnameRefs() const { return fRnameRefs; }
+   Long64_t   GetEntries() const { return fEntries; }
+   Long64_t   GetUnsortedCopy() const { return fUnsorted; }
+   Int_t      GetVersion() const { return fColumns ? 2 : 1; }
+
+   void       AddHeader(std::string_view line);
+   bool       SetCompression(const char *spec);
+   void       Fill();
+   bool       CanCopy(RAMFile &in);
+   bool       CopyTree(RAMFile &in);
+   bool       CopyCluster(RAMFile &in, Long64_t first, Long64_t last);
+   void       Close();
+};
+
+
+inline RAMWriter::RAMWriter(const char *file, const char *title, bool index, bool split, bool cache,
+                            Int_t compression_algorithm, UInt_t quality_policy, Int_t version,
+                            const char *compression)
+   : fFile(nullptr), fTree(nullptr), fRecord(nullptr), fColumns(nullptr), fHeaders(nullptr),
+     fRnameRefs(nullptr), fIndexed(index), fIndex(nullptr), fBinIndex(nullptr), fZoneMap(nullptr), fEntries(0),
+     fUnsorted(-1)
+{
+   // Create file and the RAM tree in it. When implicit multi-threading is
+   // enabled, it must be enabled before, baskets are compressed in parallel.
+   // Version 1 files have a RAMRecord branch, split unless !split, version 2
+   // files a flat branch per SAM field, compressed as given by the column
+   // compression spec compression, see RAMColumns::SetCompression(), where
+   // qname=tokenize selects the name codec. The file is not open on an
+   // invalid spec.
+
+   fFile = TFile::Open(file, "RECREATE");
+   if (!fFile || fFile->IsZombie()) {
+      ::Error("RAMWriter::RAMWriter", "cannot create file %s", file);
+      delete fFile;
+      fFile = nullptr;
+      return;
+   }
+   fRnameRefs = new RAMRefs;
+   if (fIndexed) {
+      fIndex    = new RAMIndex;
+      fBinIndex = new RAMBinIndex;
+      fZoneMap  = new RAMZoneMap;
+   }
+   fFile->SetCompressionLevel(1);     // 0 - no compression, 1..9 - min to max compression
+   fFile->SetCompressionAlgorithm(compression_algorithm);  // ROOT::kZLIB, ROOT::kLZMA, ROOT::kLZ4
+
+   // create the TTree
+   fTree = new TTree("RAM", title);
+
+   // create a branch for a RAMRecord, or the columns
+   fRecord = new RAMRecord;
+   fRecord->SetBit(quality_policy);
+
+   if (version >= 2) {
+      fColumns = new RAMColumns;
+      if (!fColumns->Branch(fTree, compression_algorithm, quality_policy, compression)) {
+         Close();
+         return;
+      }
+   } else {
+      // Select split level
+      int splitlevel = 0;
+      if (split)
+         splitlevel = 99;
+
+      fTree->Branch("RAMRecord.", &fRecord, 64000, splitlevel);
+   }
+   fTree->SetMaxTreeSize(500000000000LL);  // Default is 100GB, change to 500GB
+
+   if (!cache)
+      fTree->SetCacheSize(0);
+
+   // Store SAM header records in a list stored as UserInfo with the tree
+   fHeaders = new TList;
+   fHeaders->SetName("headers");
+   fTree->GetUserInfo()->Add(fHeaders);
+}
+
+inline void RAMWriter::AddHeader(std::string_view line)
+{
+   // Store a SAM header line as a TNamed with the record type (e.g. @SQ)
+   // as name and the rest of the line as title. The references of @SQ
+   // lines are entered in the refs, in header order and with their length,
+   // the read groups of @RG lines in the RG dictionary of version 2 files.
+
+   fRnameRefs->AddSQ(line);
+   if (fColumns)
+      fColumns->AddHeader(line);
+
+   auto tab = line.find('\t');
+   if (tab != std::string_view::npos)
+      fHeaders->Add(new TNamed(TString(line.data(), tab), TString(line.data() + tab + 1, line.size() - tab - 1)));
+   else
+      fHeaders->Add(new TNamed(TString(line.data(), line.size()), ""));
+}
+
+inline bool RAMWriter::SetCompression(const char *spec)
+{
+   // Set the compression of the columns of a version 2 file, see
+   // RAMColumns::SetCompression(). Ignored for version 1 files.
+
+   return fColumns ? fColumns->SetCompression(spec) : true;
+}
+
+inline void RAMWriter::Fill()
+{
+   // Fill the current record and update the indices.
+
+   if (fColumns)
+      fColumns->Fill(fRecord, fEntries);
+   else
+      fTree->Fill();
+   if (fIndexed) {
+      // Add index every 1000 records (this can be tuned)
+      if (fEntries % 1000 == 0)
+         fIndex->AddItem(fRecord->GetREFID(), fRecord->GetPOS(), fEntries);
+      Int_t end = fRecord->GetEND();
+      fBinIndex->AddItem(fRecord->GetREFID(), fRecord->GetPOS(), end, fEntries);
+      fZoneMap->AddItem(fRecord->GetREFID(), fRecord->GetPOS(), end, fRecord->GetFLAG(), fRecord->GetMAPQ());
+   }
+   fEntries++;
+}
+
+inline bool RAMWriter::CanCopy(RAMFile &in)
+{
+   // Check that the baskets of in can be copied to this file: in has the
+   // same version, quality policy, compression settings of every branch and
+   // tag dictionaries, the refs are the caller's business. Otherwise the
+   // records must be filled one by one.
+
+   if (in.GetVersion() != GetVersion() ||
+       (fColumns && in.GetColumns()->GetQualityPolicy() != fColumns->GetQualityPolicy()))
+      return false;
+   TIter next(in.GetTree()->GetListOfBranches());
+   while (TBranch *from = (TBranch *) next()) {
+      TBranch *to = fTree->GetBranch(from->GetName());
+      if (!to || to->GetCompressionSettings() != from->GetCompressionSettings())
+         return false;
+   }
+   return !fColumns || fColumns->AppendTags(*in.GetColumns());
+}
+
+inline bool RAMWriter::CopyTree(RAMFile &in)
+{
+   // Append all records of in, a RAM file of the same version, quality
+   // policy, compression, refs and tag dictionaries as this file, see
+   // CanCopy(), by copying its baskets
+   // in compressed form. Only the columns needed to fill the indices are
+   // read. Returns false, without copying anything, when the trees are not
+   // compatible for fast cloning.
+
+   TTree *tree = in.GetTree();
+   if (!CanCopy(in))
+      return false;
+   if (fColumns)
+      fColumns->Flush();
+   fTree->FlushBaskets();   // the cloned baskets follow the flushed ones
+   TTreeCloner cloner(tree, fTree, "", TTreeCloner::kNoWarnings);
+   if (!cloner.IsValid())
+      return false;
+
+   Long64_t nentries = tree->GetEntries();
+   fTree->SetEntries(fEntries + nentries);
+   cloner.Exec();
+   IncludeRanges(tree);
+   if (fColumns)
+      fColumns->AppendTree(fEntries, nentries, in.GetColumns()->GetSegments());
+   IndexCopied(in, 0, nentries);
+   return true;
+}
+
+inline bool RAMWriter::CopyCluster(RAMFile &in, Long64_t first, Long64_t last)
+{
+   // Append the records first to last-1 of in, a tree cluster, by copying
+   // its baskets in compressed form, like TTreeCloner does for a whole
+   // tree. The conditions are those of CopyTree(), in addition part of a
+   // tree is only copied between version 2 files and when first starts a
+   // POS block of in. Returns false, without copying anything, when the
+   // baskets of the cluster cannot be copied.
+
+   TTree *tree = in.GetTree();
+   if (first == 0 && last == tree->GetEntries())
+      return CopyTree(in);
+   if (!fColumns || first >= last || !in.GetColumns()->IsBlockStart(first) || !CanCopy(in))
+      return false;
+
+   // The baskets of each branch in the cluster, at a cluster boundary all
+   // branches start a basket
+   struct Baskets_t {
+      TBranch *fFrom, *fTo;
+      Int_t    fFirst, fLast;
+   };
+   std::vector<Baskets_t> baskets;
+   TObjArray *branches = tree->GetListOfBranches();
+   if (branches->GetEntries() != fTree->GetListOfBranches()->GetEntries())
+      return false;
+   for (Int_t i = 0; i < branches->GetEntries(); i++) {
+      Baskets_t b = { (TBranch *) branches->At(i), nullptr, 0, 0 };
+      b.fTo = fTree->GetBranch(b.fFrom->GetName());
+      Long64_t *entry = b.fFrom->GetBasketEntry();
+      Int_t nbaskets = b.fFrom->GetWriteBasket();
+      b.fFirst = std::lower_bound(entry, entry + nbaskets, first) - entry;
+      b.fLast  = std::lower_bound(entry, entry + nbaskets, last) - entry;
+      if (!b.fTo || b.fFirst == nbaskets || entry[b.fFirst] != first ||
+          (b.fLast < nbaskets ? entry[b.fLast] != last : last != b.fFrom->GetEntries()))
+         return false;
+      for (Int_t k = b.fFirst; k < b.fLast; k++)
+         if (b.fFrom->GetBasketSeek(k) == 0)
+            return false;
+      baskets.push_back(b);
+   }
+
+   fColumns->Flush();
+   fTree->FlushBaskets();   // the copied baskets follow the flushed ones
+   TFile *from = in.GetFile();
+   TFile *to   = fTree->GetCurrentFile();
+   for (auto &b : baskets) {
+      TBasket *basket = fTree->CreateBasket(b.fTo);
+      for (Int_t k = b.fFirst; k < b.fLast; k++) {
+         Long64_t seek = b.fFrom->GetBasketSeek(k);
+         if (b.fFrom->GetBasketBytes()[k] == 0)
+            b.fFrom->GetBasketBytes()[k] = basket->ReadBasketBytes(seek, from);
+         basket->LoadBasketBuffers(seek, b.fFrom->GetBasketBytes()[k], from, tree);
+         basket->CopyTo(to);
+         b.fTo->AddBasket(*basket, kTRUE, fEntries + b.fFrom->GetBasketEntry()[k] - first);
+      }
+      delete basket;
+   }
+
+   Long64_t nentries = last - first;
+   fTree->SetEntries(fEntries + nentries);
+   fTree->FlushBaskets();   // ends the cluster
+   IncludeRanges(tree);
+   std::vector<Long64_t> segments;
+   for (auto s : in.GetColumns()->GetSegments())
+      if (s > first && s < last)
+         segments.push_back(s - first);
+   fColumns->AppendTree(fEntries, nentries, segments);
+   IndexCopied(in, first, nentries);
+   return true;
+}
+
+inline void RAMWriter::IncludeRanges(TTree *tree)
+{
+   // Raise the maxima of the leaves of this tree, e.g. of ncigar or qname,
+   // to those of tree, whose baskets were copied here. Fill() only updates
+   // them for the records filled and the readers size their buffers with
+   // them, see RAMColumns::Connect().
+
+   TIter next(tree->GetListOfLeaves());
+   while (TLeaf *from = (TLeaf *) next()) {
+      TLeaf *to = fTree->GetLeaf(from->GetName());
+      if (to)
+         to->IncludeRange(from);
+   }
+}
+
+inline void RAMWriter::IndexCopied(RAMFile &in, Long64_t first, Long64_t n)
+{
+   // Update the indices with the n records of in starting at first, copied
+   // to the end of this file, and check that they are coordinate sorted,
+   // unmapped records last, see GetUnsortedCopy(). Only the columns needed
+   // are read.
+
+   const RAMRecord *rec = in.GetRecord();
+   UInt_t columns = RAMColumns::kREFID | RAMColumns::kPOS;
+   if (fIndexed)
+      columns |= RAMColumns::kFLAG | RAMColumns::kMAPQ | RAMColumns::kCIGAR;
+   in.SetColumns(columns);
+   fUnsorted = -1;
+   ULong64_t last = 0;
+   for (Long64_t i = 0; i < n; i++) {
+      in.GetEntry(first + i);
+      ULong64_t key = ((ULong64_t) (UInt_t) rec->GetREFID() << 32) | (UInt_t) (rec->GetPOS() + 1);
+      if (key < last && fUnsorted < 0)
+         fUnsorted = first + i;
+      last = key;
+      if (!fIndexed)
+         continue;
+      if ((fEntries + i) % 1000 == 0)
+         fIndex->AddItem(rec->GetREFID(), rec->GetPOS(), fEntries + i);
+      Int_t end = rec->GetEND();
+      fBinIndex->AddItem(rec->GetREFID(), rec->GetPOS(), end, fEntries + i);
+      fZoneMap->AddItem(rec->GetREFID(), rec->GetPOS(), end, rec->GetFLAG(), rec->GetMAPQ());
+   }
+   in.SetColumns(RAMColumns::kAll);
+   fEntries += n;
+}
+
+inline void RAMWriter::Close()
+{
+   // Write the tree, the refs and the index and close the file.
+
+   if (!fFile)
+      return;
+
+   fFile->cd();
+   if (fColumns)
+      fColumns->Flush();
+   fTree->Write();
+   if (fColumns)
+      fColumns->Write(fFile);
+
+   fFile->WriteObjectAny(fRnameRefs, "RAMRefs", "RnameRefs");
+   if (fIndexed) {
+      if (!fBinIndex->IsSorted())
+         ::Warning("RAMWriter::Close", "records are not coordinate sorted, the sampled index is not usable "
+                   "for region queries, sort the input with ramsort");
+      fIndex->Write(fFile);
+      // cluster boundaries are only known once the tree is written
+      fBinIndex->Finalize(fTree);
+      fBinIndex->Write(fFile);
+      fZoneMap->Finalize(fTree);
+      fZoneMap->Write(fFile);
+   }
+
+   delete fFile;   // also deletes fTree
+   fFile = nullptr;
+   fTree = nullptr;
+   delete fRecord;
+   fRecord = nullptr;
+   delete fColumns;
+   fColumns = nullptr;
+   delete fRnameRefs;
+   fRnameRefs = nullptr;
+   delete fIndex;
+   fIndex = nullptr;
+   delete fBinIndex;
+   fBinIndex = nullptr;
+   delete fZoneMap;
+   fZoneMap = nullptr;
+}
+
+#endif
@@ -0,0 +1,263 @@
+//
+// SAMFormatter writes RAMRecords as SAM text. Records are formatted
+// straight into a large reusable output buffer, integers with a two digit
+// table and SEQ and CIGAR with lookup tables from their packed encoding,
+// without going through the scratch buffers of the RAMRecord getters.
+// The buffer is written with a single write() call when full. With a file
+// descriptor < 0 the output is kept in memory, see GetData().
+// The reference names are taken from the refs given to SetRefs(), e.g. the
+// ones of a RAMFile, or else from the static refs of RAMRecord. An RNEXT
+// equal to RNAME is written as "=".
+//
+
+#ifndef SAMFormatter_h
+#define SAMFormatter_h
+
+#include <TTree.h>
+#include <TList.h>
+#include <TNamed.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+
+#include "ramrecord.h"
+
+
+class SAMFormatter {
+private:
+   int               fFd;            // output file descriptor
+   std::vector<char> fBuf;           // output buffer
+   size_t            fLen;           // bytes used in fBuf
+   Long64_t          fBytesWritten;  // total bytes written to fFd
+   bool              fError;         // write error
+   const RAMRefs    *fRnameRefs;     // refs of RNAME and RNEXT, 0 for the RAMRecord refs
+   const RAMRefs    *fRnextRefs;     // separate refs of RNEXT of older files, or 0
+
+   char        *Reserve(size_t n);
+   static char *PutUInt(char *p, UInt_t v);
+   static char *PutInt(char *p, Int_t v) {
+      if (v < 0) {
+         *p++ = '-';
+         return PutUInt(p, 0U - (UInt_t) v);
+      }
+      return PutUInt(p, v);
+   }
+   static char *PutString(char *p, const char *s, size_t n) { memcpy(p, s, n); return p + n; }
+   static const char *RefName(const RAMRefs *refs, Int_t refid) {
+      return refid < 0 || refid >= (Int_t) refs->Size() ? "*" : refs->GetRefName(refid);
+   }
+
+public:
+   SAMFormatter(int fd = 1, size_t bufsize = 4*1024*1024)
+      : fFd(fd), fBuf(bufsize), fLen(0), fBytesWritten(0), fError(false), fRnameRefs(nullptr),
+        fRnextRefs(nullptr) { }
+   ~SAMFormatter() { Flush(); }
+
+   void     SetRefs(const RAMRefs *rname, const RAMRefs *rnext) { fRnameRefs = rname; fRnextRefs = rnext; }
+   void     WriteHeaders(TTree *tree);
+   void     Write(const RAMRecord *r);
+   void     Write(const char *text, size_t len);
+   bool     Flush();
+
+   const char *GetData() const { return fBuf.data(); }
+   size_t   GetSize() const { return fLen; }
+   void     Clear() { fLen = 0; }
+
+   Long64_t GetBytesWritten() const { return fBytesWritten + fLen; }
+   bool     IsError() const { return fError; }
+};
+
+
+inline char *SAMFormatter::PutUInt(char *p, UInt_t v)
+{
+   // Format v in decimal at p, two digits at a time. Returns the end.
+
+   static const char digits[] =
+      "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+      "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+      "8081828384858687888990919293949596979899";
+
+   char tmp[10];
+   char *e = tmp + sizeof(tmp);
+   while (v >= 100) {
+      UInt_t i = (v % 100) * 2;
+      v /= 100;
+      e -= 2;
+      memcpy(e, digits + i, 2);
+   }
+   if (v >= 10) {
+      e -= 2;
+      memcpy(e, digits + v*2, 2);
+   } else
+      *--e = '0' + v;
+
+   size_t n = tmp + sizeof(tmp) - e;
+   memcpy(p, e, n);
+   return p + n;
+}
+
+inline char *SAMFormatter::Reserve(size_t n)
+{
+   // Return a pointer to at least n free bytes in the buffer, flushing or
+   // growing the buffer when needed.
+
+   if (fLen + n > fBuf.size()) {
+      if (fFd < 0)
+         fBuf.resize(std::max(2*fBuf.size(), fLen + n));
+      else {
+         Flush();
+         if (n > fBuf.size())
+            fBuf.resize(n);
+      }
+   }
+   return fBuf.data() + fLen;
+}
+
+inline bool SAMFormatter::Flush()
+{
+   // Write the buffer to the output. Returns false on a write error, in
+   // which case further output is discarded. In memory mode this is a no-op.
+
+   if (fFd < 0)
+      return true;
+
+   size_t off = 0;
+   while (off < fLen && !fError) {
+      ssize_t n = ::write(fFd, fBuf.data() + off, fLen - off);
+      if (n < 0) {
+         if (errno == EINTR)
+            continue;
+         ::Error("SAMFormatter::Flush", "write failed: %s", strerror(errno));
+         fError = true;
+         break;
+      }
+      off += n;
+   }
+   fBytesWritten += off;
+   fLen = 0;
+   return !fError;
+}
+
+inline void SAMFormatter::Write(const char *text, size_t len)
+{
+   // Write raw text.
+
+   char *p = Reserve(len);
+   memcpy(p, text, len);
+   fLen += len;
+}
+
+inline void SAMFormatter::WriteHeaders(TTree *tree)
+{
+   // Write the SAM header lines stored in the "headers" list of the tree's
+   // UserInfo. Each line is stored as a TNamed with the record type as
+   // name and the rest of the line as title.
+
+   TList *headers = tree ? (TList *) tree->GetUserInfo()->FindObject("headers") : nullptr;
+   if (!headers)
+      return;
+
+   TIter next(headers);
+   while (TNamed *h = (TNamed *) next()) {
+      size_t ln = strlen(h->GetName());
+      size_t lt = strlen(h->GetTitle());
+      char *p = Reserve(ln + lt + 2);
+      char *s = p;
+      p = PutString(p, h->GetName(), ln);
+      if (lt) {
+         *p++ = '\t';
+         p = PutString(p, h->GetTitle(), lt);
+      }
+      *p++ = '\n';
+      fLen += p - s;
+   }
+}
+
+inline void SAMFormatter::Write(const RAMRecord *r)
+{
+   // Append record r as a SAM line.
+
+   static const char *codetocigar = "MIDNSHP=X";
+
+   const char *qname = r->GetQNAME();
+   const char *rname, *rnext;
+   if (!fRnameRefs) {
+      rname = r->GetRNAME(RAMRecord::GetRnameRefs());
+      rnext = r->GetRNEXT(RAMRecord::GetRnameRefs(), RAMRecord::GetRnextRefs());
+   } else {
+      rname = RefName(fRnameRefs, r->GetREFID());
+      if (fRnextRefs)
+         rnext = RefName(fRnextRefs, r->GetREFNEXT());
+      else if (r->GetREFNEXT() >= 0 && r->GetREFNEXT() == r->GetREFID())
+         rnext = "=";
+      else
+         rnext = RefName(fRnameRefs, r->GetREFNEXT());
+   }
+   size_t lqname = strlen(qname);
+   size_t lrname = strlen(rname);
+   size_t lrnext = strlen(rnext);
+
+   Int_t          lseq   = r->GetSEQLEN();
+   Int_t          nops   = r->GetNCIGAROP();
+   const UInt_t  *cigar  = r->GetRawCIGAR();
+   const UChar_t *seq    = r->GetRawSEQ();
+   const UChar_t *qual   = r->GetRawQUAL();
+   if (!cigar) nops = 0;
+
+   size_t lopt = 0;
+   for (int i = 0; i < r->GetNOPT(); i++)
+      lopt += strlen(r->GetOPT(i)) + 1;
+
+   // upper bound on the line length
+   size_t need = lqname + lrname + lrnext + lopt + 2*(size_t)lseq + 11*(size_t)nops + 6*12 + 16;
+   char *p = Reserve(need);
+   char *start = p;
+
+   p = PutString(p, qname, lqname);             *p++ = '\t';
+   p = PutUInt(p, r->GetFLAG());                *p++ = '\t';
+   p = PutString(p, rname, lrname);             *p++ = '\t';
+   p = PutInt(p, r->GetPOS() + 1);              *p++ = '\t';
+   p = PutUInt(p, r->GetMAPQ());                *p++ = '\t';
+   if (nops == 0)
+      *p++ = '*';
+   for (int i = 0; i < nops; i++) {
+      p = PutUInt(p, cigar[i] >> 4);
+      *p++ = codetocigar[cigar[i] & 0xf];
+   }
+   *p++ = '\t';
+   p = PutString(p, rnext, lrnext);             *p++ = '\t';
+   p = PutInt(p, r->GetPNEXT() + 1);            *p++ = '\t';
+   p = PutInt(p, r->GetTLEN());                 *p++ = '\t';
+
+   // SEQ
+   if (lseq == 0 || !seq)
+      *p++ = '*';
+   else {
+      RAMKernels::UnpackSEQ(seq, lseq, p);
+      p += lseq;
+   }
+   *p++ = '\t';
+
+   // QUAL, missing qualities are stored as '*' followed by 0's
+   if (lseq == 0 || !qual || r->TestBit(RAMRecord::kDrop) ||
+       (qual[0] == '*' && (lseq == 1 || qual[1] == 0)))
+      *p++ = '*';
+   else if (r->TestBit(RAMRecord::kIlluminaBinning)) {
+      RAMKernels::ShiftQUAL(qual, lseq, (UChar_t *) p, 33);
+      p += lseq;
+   } else
+      p = PutString(p, (const char *) qual, lseq);
+
+   for (int i = 0; i < r->GetNOPT(); i++) {
+      const char *opt = r->GetOPT(i);
+      *p++ = '\t';
+      p = PutString(p, opt, strlen(opt));
+   }
+   *p++ = '\n';
+
+   fLen += p - start;
+}
+
+#endif
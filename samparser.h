@@ -0,0 +1,324 @@
+//
+// SAMParser splits SAM text into lines and fields without copying. The
+// input file is memory mapped, or, when that is not possible (pipes,
+// stdin), read in large blocks. There is no limit on the line length.
+// Fields are returned as string_views pointing into the input and are
+// handed as such to the RAMRecord setters.
+//
+
+#ifndef SAMParser_h
+#define SAMParser_h
+
+#include <ROOT/RStringView.hxx>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "ramrecord.h"
+
+
+class SAMParser {
+private:
+   int               fFd;          // input file descriptor
+   const char       *fMap;         // memory mapped input, or nullptr when streaming
+   size_t            fMapSize;     // size of the memory mapped input
+   std::vector<char> fBuf;         // block buffer when streaming
+   size_t            fBegin;       // first unconsumed byte in fMap or fBuf
+   size_t            fEnd;         // end of valid data in fMap or fBuf
+   bool              fEof;         // no more data to read from fFd
+   Long64_t          fBytesRead;   // total bytes consumed
+
+   static const size_t kBlockSize = 16*1024*1024;
+
+   bool Fill(size_t need);
+
+public:
+   SAMParser() : fFd(-1), fMap(nullptr), fMapSize(0), fBegin(0), fEnd(0), fEof(false), fBytesRead(0) { }
+   ~SAMParser() { Close(); }
+
+   bool     Open(const char *file);
+   void     Close();
+   bool     IsMapped() const { return fMap != nullptr; }
+   Long64_t GetBytesRead() const { return fBytesRead; }
+
+   int      Peek();
+   bool     NextLine(std::string_view &line);
+   bool     NextChunk(size_t size, std::string &storage, std::string_view &chunk);
+
+   static const char *FindTab(const char *p, const char *end);
+   static bool        NextLine(std::string_view &text, std::string_view &line);
+   static Long64_t    ParseInt(std::string_view s);
+   static bool        ParseRecord(std::string_view line, RAMRecord *r, std::string_view &rname,
+                                  std::string_view &rnext);
+};
+
+
+inline bool SAMParser::Open(const char *file)
+{
+   // Open file, "-" is stdin. Regular files are memory mapped.
+
+   Close();
+
+   if (!strcmp(file, "-"))
+      fFd = dup(0);
+   else
+      fFd = open(file, O_RDONLY);
+   if (fFd < 0)
+      return false;
+
+   struct stat st;
+   if (fstat(fFd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fFd, 0);
+      if (m != MAP_FAILED) {
+         madvise(m, st.st_size, MADV_SEQUENTIAL);
+         fMap     = (const char *) m;
+         fMapSize = st.st_size;
+         fEnd     = fMapSize;
+         fEof     = true;
+         return true;
+      }
+   }
+
+   fBuf.resize(kBlockSize);
+   return true;
+}
+
+inline void SAMParser::Close()
+{
+   if (fMap)
+      munmap((void *) fMap, fMapSize);
+   if (fFd >= 0)
+      close(fFd);
+   fFd        = -1;
+   fMap       = nullptr;
+   fMapSize   = 0;
+   fBegin     = 0;
+   fEnd       = 0;
+   fEof       = false;
+   fBytesRead = 0;
+   std::vector<char>().swap(fBuf);
+}
+
+inline bool SAMParser::Fill(size_t need)
+{
+   // Streaming mode: make sure at least need bytes are available after
+   // fBegin, moving the unconsumed data to the front of the buffer and
+   // growing it if necessary. Returns false when fewer bytes are available
+   // at end of input.
+
+   while (fEnd - fBegin < need && !fEof) {
+      if (fBegin > 0) {
+         memmove(fBuf.data(), fBuf.data() + fBegin, fEnd - fBegin);
+         fEnd  -= fBegin;
+         fBegin = 0;
+      }
+      if (fEnd == fBuf.size())
+         fBuf.resize(2*fBuf.size());
+      ssize_t n = read(fFd, fBuf.data() + fEnd, fBuf.size() - fEnd);
+      if (n <= 0)
+         fEof = true;
+      else
+         fEnd += n;
+   }
+   return fEnd - fBegin >= need;
+}
+
+inline int SAMParser::Peek()
+{
+   // Return the next input character without consuming it, -1 at end of input.
+
+   if (!fMap && !Fill(1))
+      return -1;
+   if (fBegin >= fEnd)
+      return -1;
+   return (UChar_t) (fMap ? fMap[fBegin] : fBuf[fBegin]);
+}
+
+inline bool SAMParser::NextLine(std::string_view &line)
+{
+   // Return the next line, without the terminating [\r]\n. In streaming
+   // mode the line is only valid until the next call.
+
+   const char *base = fMap ? fMap : fBuf.data();
+   const char *nl = nullptr;
+   size_t scanned = 0;
+   while (true) {
+      base = fMap ? fMap : fBuf.data();
+      nl = (const char *) memchr(base + fBegin + scanned, '\n', fEnd - fBegin - scanned);
+      if (nl || fMap || fEof)
+         break;
+      scanned = fEnd - fBegin;
+      Fill(fEnd - fBegin + 1);
+   }
+
+   if (fBegin >= fEnd)
+      return false;
+
+   const char *p   = base + fBegin;
+   const char *eol = nl ? nl : base + fEnd;
+   size_t consumed = eol - p + (nl ? 1 : 0);
+   fBegin     += consumed;
+   fBytesRead += consumed;
+
+   if (eol > p && eol[-1] == '\r')
+      eol--;
+   line = std::string_view(p, eol - p);
+   return true;
+}
+
+inline bool SAMParser::NextChunk(size_t size, std::string &storage, std::string_view &chunk)
+{
+   // Return a chunk of about size bytes ending on a line boundary. When the
+   // input is memory mapped the chunk points into the mapping, otherwise the
+   // data is copied into storage, which must stay alive as long as chunk is
+   // used. Chunks are used to hand out work to several parsing threads.
+
+   const char *base;
+   if (fMap) {
+      base = fMap;
+   } else {
+      Fill(size);
+      base = fBuf.data();
+   }
+   if (fBegin >= fEnd)
+      return false;
+
+   size_t len = fEnd - fBegin;
+   if (len > size) {
+      // extend to the end of the line crossing size
+      const char *nl = (const char *) memchr(base + fBegin + size, '\n', len - size);
+      while (!nl && !fMap && !fEof) {
+         size_t scanned = len;
+         Fill(len + 1);
+         base = fBuf.data();
+         len  = fEnd - fBegin;
+         nl   = (const char *) memchr(base + fBegin + scanned, '\n', len - scanned);
+      }
+      if (nl)
+         len = nl - (base + fBegin) + 1;
+   } else if (!fMap && !fEof) {
+      // short read, only hand out complete lines
+      const char *nl = (const char *) memrchr(base + fBegin, '\n', len);
+      if (nl)
+         len = nl - (base + fBegin) + 1;
+   }
+
+   if (fMap) {
+      chunk = std::string_view(base + fBegin, len);
+   } else {
+      storage.assign(base + fBegin, len);
+      chunk = std::string_view(storage);
+   }
+   fBegin     += len;
+   fBytesRead += len;
+   return true;
+}
+
+inline const char *SAMParser::FindTab(const char *p, const char *end)
+{
+   // Return pointer to the next tab in [p,end), or end when there is none.
+
+#ifdef __AVX2__
+   const __m256i tab = _mm256_set1_epi8('\t');
+   while (p + 32 <= end) {
+      __m256i  v    = _mm256_loadu_si256((const __m256i *) p);
+      unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, tab));
+      if (mask)
+         return p + __builtin_ctz(mask);
+      p += 32;
+   }
+#endif
+   const char *t = (const char *) memchr(p, '\t', end - p);
+   return t ? t : end;
+}
+
+inline bool SAMParser::NextLine(std::string_view &text, std::string_view &line)
+{
+   // Split the next line, without the terminating [\r]\n, off text.
+
+   if (text.empty())
+      return false;
+
+   const char *p  = text.data();
+   const char *nl = (const char *) memchr(p, '\n', text.size());
+   size_t len     = nl ? nl - p : text.size();
+   text.remove_prefix(nl ? len + 1 : len);
+   if (len > 0 && p[len-1] == '\r')
+      len--;
+   line = std::string_view(p, len);
+   return true;
+}
+
+inline Long64_t SAMParser::ParseInt(std::string_view s)
+{
+   // Decimal string to integer, no checking, stops at the first non digit.
+
+   const char *p   = s.data();
+   const char *end = p + s.size();
+   bool neg = false;
+   if (p < end && (*p == '-' || *p == '+'))
+      neg = *p++ == '-';
+   Long64_t v = 0;
+   for (; p < end; p++) {
+      unsigned d = (UChar_t) *p - '0';
+      if (d > 9)
+         break;
+      v = v * 10 + d;
+   }
+   return neg ? -v : v;
+}
+
+inline bool SAMParser::ParseRecord(std::string_view line, RAMRecord *r, std::string_view &rname,
+                                   std::string_view &rnext)
+{
+   // Parse a SAM alignment line into r. RNAME and RNEXT are returned as
+   // views as they have to be converted to refids in input order, which is
+   // not guaranteed when records are parsed in several threads. Returns
+   // false if the line has less than the 11 mandatory fields.
+
+   const char *p   = line.data();
+   const char *end = p + line.size();
+   std::string_view f[11];
+   int nf = 0;
+   while (nf < 11) {
+      const char *t = FindTab(p, end);
+      f[nf++] = std::string_view(p, t - p);
+      if (t == end)
+         break;
+      p = t + 1;
+   }
+   if (nf < 11)
+      return false;
+
+   r->SetQNAME(f[0].data(), f[0].size());
+   r->SetFLAG(ParseInt(f[1]));
+   rname = f[2];
+   r->SetPOS(ParseInt(f[3]));
+   r->SetMAPQ(ParseInt(f[4]));
+   r->SetCIGAR(f[5].data(), f[5].size());
+   rnext = f[6];
+   r->SetPNEXT(ParseInt(f[7]));
+   r->SetTLEN(ParseInt(f[8]));
+   r->SetSEQ(f[9].data(), f[9].size());
+   r->SetQUAL(f[10].data(), f[10].size());
+
+   // opt's
+   r->ResetNOPT();
+   const char *q = f[10].data() + f[10].size();
+   while (q < end) {
+      q++;
+      const char *t = FindTab(q, end);
+      r->SetOPT(q, t - q);
+      q = t;
+   }
+   return true;
+}
+
+#endif
@@ -4,10 +4,12 @@
 // Author: Jose Javier Gonzalez Ortiz, 6/6/2017
 //
 
+#ifndef RAMUtils_h
+#define RAMUtils_h
 
-void stripcrlf(char *tok);
+#include <cstring>
 
-void stripcrlf(char *tok)
+inline void stripcrlf(char *tok)
 {
    int l = strlen(tok);
    if (l > 0 && tok[l-1] == '\n') {
@@ -17,3 +19,5 @@ void stripcrlf(char *tok)
          tok[l-1] = '\0';
    }
 }
+
+#endif